@@ -34,6 +34,19 @@ JB:
             - added FileReadEx()
 2009-12-15  - all entries are now sorted by name with extension
             - directory short names are displayed with extensions
+2010-09-13  - FileCreate() allocates as many clusters as the file size requires
+            - added SetFATLink(), AllocateCluster() and GetFATChecksum()
+2010-09-15  - added FileWriteEx()
+2010-09-16  - UpdateEntry() accepts larger size when the clusters have been appended with AllocateCluster()
+            - FileWriteEx() writes zeros when pBuffer is NULL
+2010-09-19  - ScanDirectory() yields to floppy and IDE requests between directory sectors
+2010-09-28  - added FileOpenDir() to open files in subdirectories
+2010-09-29  - ScanDirectory() accepts several extensions (e.g. "ADFADC")
+2010-10-03  - FileReadEx() advances the buffer between clusters and may read up to the end of the cluster chain
+2010-10-06  - SetFATLink() changes are written by FlushFAT() once per FAT sector
+            - GetFATChecksum() replaced with GetChainChecksum()
+            - added cluster_shift
+2010-10-07  - GetChainChecksum() removed
 
 */
 
@@ -42,6 +55,7 @@ JB:
 #include <ctype.h>
 #include "MMC.h"
 #include "FAT.h"
+#include "tasks.h"
 
 unsigned short directory_cluster;       // first cluster of directory (0 if root)
 unsigned short entries_per_cluster;     // number of directory entries per cluster
@@ -57,13 +71,17 @@ unsigned long root_directory_size;      // size of directory region in sectors
 unsigned char fat_number;               // number of FAT tables
 unsigned char cluster_size;             // size of a cluster in sectors
 unsigned long cluster_mask;             // binary mask of cluster number
+unsigned char cluster_shift;            // log2 of cluster size in sectors
 unsigned short dir_entries;             // number of entry's in directory table
 unsigned long fat_size;                 // size of fat
+unsigned long cluster_count;            // number of clusters in the data region plus two reserved entries
 
-unsigned char sector_buffer[512];       // sector buffer
+unsigned char sector_buffer[512] __attribute__((aligned(4))); // sector buffer (also accessed as 32-bit words)
 
 FATBUFFER fat_buffer;                   // buffer for caching fat entries
 unsigned long buffered_fat_index;       // index of buffered FAT sector
+unsigned char fat_dirty;                // buffered FAT sector has been changed and not written yet
+unsigned long fat_reads;                // number of FAT sector reads (statistics)
 
 char DirEntryLFN[MAXDIRENTRIES][261];
 DIRENTRY DirEntry[MAXDIRENTRIES];
@@ -86,6 +104,7 @@ extern void ErrorMessage(const char *message, unsigned char code);
 unsigned char FindDrive(void)
 {
     buffered_fat_index = -1;
+    fat_dirty = 0;
 
     if (!MMC_Read(0, sector_buffer)) // read MBR
         return(0);
@@ -190,6 +209,15 @@ unsigned char FindDrive(void)
         data_start = root_directory_start + root_directory_size;
     }
 
+    for (cluster_shift = 0; (1 << cluster_shift) < cluster_size; cluster_shift++);
+
+    // total number of sectors in the volume
+    cluster_count = sector_buffer[19] + (sector_buffer[20] << 8);
+    if (cluster_count == 0)
+        cluster_count = sector_buffer[32] + (sector_buffer[33] << 8) + (sector_buffer[34] << 16) + (sector_buffer[35] << 24);
+
+    // convert to number of clusters (first valid cluster number is 2)
+    cluster_count = (cluster_count - (data_start - boot_sector)) / cluster_size + 2;
 
     // some debug output
     printf("fat_size: %lu\r", fat_size);
@@ -200,13 +228,19 @@ unsigned char FindDrive(void)
     printf("data_start: %lu\r", data_start);
     printf("cluster_size: %u\r", cluster_size);
     printf("cluster_mask: %08lX\r", cluster_mask);
+    printf("cluster_count: %lu\r", cluster_count);
 
     return(1);
 }
 
 unsigned char FileOpen(fileTYPE *file, char *name)
 {
-    unsigned long  iDirectory = 0;       // only root directory is supported
+    return(FileOpenDir(file, name, 0)); // root directory
+}
+
+unsigned char FileOpenDir(fileTYPE *file, char *name, unsigned long iDirectory)
+{
+    // iDirectory is the start cluster of a subdirectory or 0 for root directory
     DIRENTRY      *pEntry = NULL;        // pointer to current entry in sector buffer
     unsigned long  iDirectorySector;     // current sector of directory entries table
     unsigned long  iDirectoryCluster;    // start cluster of subdirectory or FAT32 root directory
@@ -354,6 +388,18 @@ int CompareDirEntries(DIRENTRY *pDirEntry1, char *pLFN1, DIRENTRY *pDirEntry2, c
     return(rc);
 }
 
+unsigned char CompareExtension(const char *name, const char *extension)
+{
+    // extension string may hold several 3 character extensions
+    while (*extension)
+    {
+        if (strncmp(name, extension, 3) == 0)
+            return(1);
+        extension += 3;
+    }
+    return(0);
+}
+
 char ScanDirectory(unsigned long mode, char *extension, unsigned char options)
 {
     DIRENTRY *pEntry = NULL;            // pointer to current entry in sector buffer
@@ -455,6 +501,7 @@ char ScanDirectory(unsigned long mode, char *extension, unsigned char options)
         {
             if ((iEntry & 0xF) == 0) // first entry in sector, load the sector
             {
+                Yield(TASK_FDD | TASK_IDE); // sector_buffer is reloaded below
                 MMC_Read(iDirectorySector++, sector_buffer);
                 pEntry = (DIRENTRY*)sector_buffer;
             }
@@ -509,7 +556,7 @@ char ScanDirectory(unsigned long mode, char *extension, unsigned char options)
 
                     if (!(pEntry->Attributes & (ATTR_VOLUME | ATTR_HIDDEN)) && (pEntry->Name[0] != '.' || pEntry->Name[1] != ' ')) // if not VOLUME label (also filter current directory entry)
                     {
-                        if (extension[0] == '*' || strncmp((const char*)&pEntry->Name[8], extension, 3) == 0 || options & SCAN_DIR && pEntry->Attributes & ATTR_DIRECTORY)
+                        if (extension[0] == '*' || CompareExtension((const char*)&pEntry->Name[8], extension) || options & SCAN_DIR && pEntry->Attributes & ATTR_DIRECTORY)
                         {
                             if (mode == SCAN_INIT)
                             { // scan the directory table and return first MAXDIRENTRIES alphabetically sorted entries
@@ -924,6 +971,10 @@ unsigned long GetFATLink(unsigned long cluster)
     // read the desired FAT sector if not already in the buffer
     if (fat_index != buffered_fat_index)
     {
+        if (!FlushFAT())
+            return(0);
+
+        fat_reads++;
         if (!MMC_Read(fat_start+fat_index, (unsigned char*)&fat_buffer))
             return(0);
 
@@ -960,6 +1011,10 @@ unsigned char FileNextSector(fileTYPE *file)
         // read sector of FAT if not already in the buffer
         if (sb != buffered_fat_index)
         {
+            if (!FlushFAT())
+                return(0);
+
+            fat_reads++;
             if (!MMC_Read(fat_start + sb, (unsigned char*)&fat_buffer))
                 return(0);
 
@@ -1014,6 +1069,10 @@ unsigned char FileSeek(fileTYPE *file, unsigned long offset, unsigned long origi
 
         if (sb != buffered_fat_index)
         {
+            if (!FlushFAT())
+                return(0);
+
+            fat_reads++;
             if (!MMC_Read(fat_start + sb, (unsigned char*)&fat_buffer)) // read sector of FAT if not already in the buffer
                 return(0);
 
@@ -1071,10 +1130,12 @@ unsigned char FileReadEx(fileTYPE *file, unsigned char *pBuffer, unsigned long n
         if (!MMC_ReadMultiple(sb, pBuffer, bc))
             return 0;
 
-        if (!FileSeek(file, bc, SEEK_CUR))
-            return 0;
-
         nSize -= bc;
+        if (pBuffer) // NULL is direct transfer to the FPGA
+            pBuffer += bc << 9;
+
+        if (!FileSeek(file, bc, SEEK_CUR) && nSize) // there is no next cluster after the last sector of the file
+            return 0;
     }
 
     return 1;
@@ -1091,6 +1152,35 @@ unsigned char FileWrite(fileTYPE *file,unsigned char *pBuffer)
     return(MMC_Write(sector, pBuffer)); // write sector from drive
 }
 
+unsigned char FileWriteEx(fileTYPE *file, unsigned char *pBuffer, unsigned long nSize)
+{
+    unsigned long sb;
+    unsigned long bc; // block count of single multisector write operation
+
+    while (nSize)
+    {
+        sb = data_start;                         // start of data in partition
+        sb += cluster_size * (file->cluster-2);  // cluster offset
+        sb += file->sector & ~cluster_mask;      // sector offset in cluster
+        bc = cluster_size - (file->sector & ~cluster_mask); // sector offset in the cluster
+        if (nSize < bc)
+            bc = nSize;
+
+        if (!MMC_WriteMultiple(sb, pBuffer, bc))
+            return 0;
+
+        nSize -= bc;
+        if (pBuffer)
+            pBuffer += bc << 9;
+
+        if (nSize) // don't move past the end of the last cluster
+            if (!FileSeek(file, bc, SEEK_CUR))
+                return 0;
+    }
+
+    return 1;
+}
+
 unsigned char FileCreate(unsigned long iDirectory, fileTYPE *file)
 {
     // TODO: deleted entries are not empty, they have to be cleared first
@@ -1138,92 +1228,59 @@ unsigned char FileCreate(unsigned long iDirectory, fileTYPE *file)
             {
                 printf("Empty entry found in sector %lu at index %lu\r", iDirectorySector-1, iEntry&0x0F);
 
-                // free cluster is marked as 0x0000
-                // last cluster in chain is 0xFFFF
-                unsigned long fat_index = 0; // first sector of FAT
-                unsigned long buffer_index = 2;  // two first entries are reserved
-                while (fat_index < fat_size)
+                // allocate clusters for the requested file size (at least one)
+                unsigned long n = (file->size + (cluster_size << 9) - 1) / (cluster_size << 9);
+                unsigned long cluster = 0;
+                unsigned long first_cluster = 0;
+
+                if (n == 0)
+                    n = 1;
+
+                while (n--)
                 {
-                    // read sector of FAT if not already in the buffer
-                    if (fat_index != buffered_fat_index)
+                    cluster = AllocateCluster(cluster);
+                    if (!cluster)
                     {
-                        if (!MMC_Read(fat_start + fat_index, (unsigned char*)&fat_buffer))
-                        {
-                            printf("FileCreate(): FAT read failed!\r");
-                            return(0);
-                        }
-                        // remember current buffer index
-                        buffered_fat_index = fat_index;
+                        printf("FileCreate(): cluster allocation failed!\r");
+                        FlushFAT();
+                        return(0);
                     }
 
-                    unsigned long buffer_size = fat32 ? 128 : 256;
-                    while (buffer_index < buffer_size)
-                    { // search through all entries in current sector
-
-                        if ((fat32 ? fat_buffer.fat32[buffer_index] : fat_buffer.fat16[buffer_index]) == 0)
-                        {   // empty cluster found
-                            unsigned long cluster = (fat_index << (fat32 ? 7 : 8)) + buffer_index;  // calculate cluster number
-
-                            printf("Empty cluster: %lu\r", cluster);
-
-                            // mark cluster as used
-                            if (fat32)
-                                fat_buffer.fat32[buffer_index] = 0x0FFFFFFF; // FAT32 EOC
-                            else
-                                fat_buffer.fat16[buffer_index] = 0xFFFF; // FAT16 EOC
-
-                            // store FAT sector
-                            if (!MMC_Write(fat_start + fat_index, (unsigned char*)&fat_buffer))
-                            {
-                                printf("FileCreate(): FAT write failed!\r");
-                                return(0);
-                            }
-
-                            // update FAT copies
-                            unsigned long i;
-                            for (i = 1; i < fat_number; i++)
-                            {
-                                if (!MMC_Write(fat_start + (i * fat_size) + fat_index, (unsigned char*)&fat_buffer))
-                                {
-                                    printf("FileCreate(): FAT copy #%lu write failed!\r", i);
-                                    return(0);
-                                }
-                            }
-
-                            // initialize direntry
-                            memset((void*)pEntry, 0, sizeof(DIRENTRY));
-                            memcpy((void*)pEntry->Name, file->name, 11);
-                            pEntry->Attributes = file->attributes;
-                            pEntry->CreateDate = FILEDATE(2009, 9, 1);
-                            pEntry->CreateTime = FILETIME(0, 0, 0);
-                            pEntry->AccessDate = FILEDATE(2009, 9, 1);
-                            pEntry->ModifyDate = FILEDATE(2009, 9, 1);
-                            pEntry->ModifyTime = FILETIME(0, 0, 0);
-                            pEntry->StartCluster = (unsigned short)cluster;
-                            pEntry->HighCluster = fat32 ? (unsigned short)(cluster >> 16) : 0;
-                            pEntry->FileSize = file->size;
-
-                            // store dir entry
-                            if (!MMC_Write(iDirectorySector - 1, sector_buffer))
-                            {
-                                printf("FileCreate(): directory write failed!\r");
-                                return(0);
-                            }
-
-                            file->start_cluster = cluster;
-                            file->cluster = cluster;
-                            file->sector = 0;
-                            file->entry.sector = iDirectorySector - 1;
-                            file->entry.index = iEntry & 0x0F;
+                    if (!first_cluster)
+                        first_cluster = cluster;
+                }
 
-                            return(1);
-                        }
-                        buffer_index++;
-                    }
-                    buffer_index = 0; // go to the start of sector
-                    fat_index++; // go to the next sector of FAT
+                if (!FlushFAT())
+                    return(0);
+
+                printf("First cluster: %lu\r", first_cluster);
+
+                // initialize direntry
+                memset((void*)pEntry, 0, sizeof(DIRENTRY));
+                memcpy((void*)pEntry->Name, file->name, 11);
+                pEntry->Attributes = file->attributes;
+                pEntry->CreateDate = FILEDATE(2009, 9, 1);
+                pEntry->CreateTime = FILETIME(0, 0, 0);
+                pEntry->AccessDate = FILEDATE(2009, 9, 1);
+                pEntry->ModifyDate = FILEDATE(2009, 9, 1);
+                pEntry->ModifyTime = FILETIME(0, 0, 0);
+                pEntry->StartCluster = (unsigned short)first_cluster;
+                pEntry->HighCluster = fat32 ? (unsigned short)(first_cluster >> 16) : 0;
+                pEntry->FileSize = file->size;
+
+                // store dir entry
+                if (!MMC_Write(iDirectorySector - 1, sector_buffer))
+                {
+                    printf("FileCreate(): directory write failed!\r");
+                    return(0);
                 }
 
+                file->start_cluster = first_cluster;
+                file->cluster = first_cluster;
+                file->sector = 0;
+                file->entry.sector = iDirectorySector - 1;
+                file->entry.index = iEntry & 0x0F;
+
                 return(1);
             }
         }
@@ -1245,7 +1302,105 @@ unsigned char FileCreate(unsigned long iDirectory, fileTYPE *file)
     return(0);
 }
 
-// changing of allocated cluster number is not supported - new size must be within current cluster number
+// writes all FAT copies of the buffered FAT sector if it has been changed
+unsigned char FlushFAT(void)
+{
+    unsigned long i;
+
+    if (!fat_dirty)
+        return(1);
+
+    for (i = 0; i < fat_number; i++)
+    {
+        if (!MMC_Write(fat_start + (i * fat_size) + buffered_fat_index, (unsigned char*)&fat_buffer))
+        {
+            printf("FlushFAT(): FAT #%lu write failed!\r", i);
+            return(0);
+        }
+    }
+
+    fat_dirty = 0;
+    return(1);
+}
+
+// changes the FAT entry of the given cluster in the FAT buffer, the sector is written by FlushFAT()
+// (called by the FAT functions before another FAT sector is loaded)
+unsigned char SetFATLink(unsigned long cluster, unsigned long link)
+{
+    unsigned long fat_index;
+    unsigned short buffer_index;
+
+    if (fat32)
+    {
+        fat_index    = cluster >> 7;    // calculate sector number in the FAT32 that contains the desired link (128 links per sector)
+        buffer_index = cluster & 0x7F;  // calculate offset in the buffered FAT32 sector containing the link
+    }
+    else
+    {
+        fat_index    = cluster >> 8;    // calculate sector number in the FAT16 that contains the desired link (256 links per sector)
+        buffer_index = cluster & 0xFF;  // calculate offset in the buffered FAT16 sector containing the link
+    }
+
+    // read the desired FAT sector if not already in the buffer
+    if (fat_index != buffered_fat_index)
+    {
+        if (!FlushFAT())
+            return(0);
+
+        fat_reads++;
+        if (!MMC_Read(fat_start + fat_index, (unsigned char*)&fat_buffer))
+            return(0);
+
+        buffered_fat_index = fat_index;
+    }
+
+    if (fat32)
+        fat_buffer.fat32[buffer_index] = (fat_buffer.fat32[buffer_index] & 0xF0000000) | (link & 0x0FFFFFFF); // upper 4 bits are reserved
+    else
+        fat_buffer.fat16[buffer_index] = (unsigned short)link;
+
+    fat_dirty = 1;
+    return(1);
+}
+
+// finds a free cluster, marks it as the end of chain and links it to the previous cluster (if given)
+// returns the allocated cluster number or 0 when the volume is full
+// the caller has to call FlushFAT() when all clusters have been allocated
+unsigned long AllocateCluster(unsigned long previous)
+{
+    unsigned long start;
+    unsigned long cluster;
+
+    start = previous + 1; // look for a cluster following the previous one to keep the chain contiguous
+    if (start < 2 || start >= cluster_count)
+        start = 2;
+
+    cluster = start;
+    do
+    {
+        if (GetFATLink(cluster) == 0) // free cluster is marked as 0
+        {
+            if (!SetFATLink(cluster, fat32 ? 0x0FFFFFFF : 0xFFFF)) // mark as the last cluster in chain
+                return(0);
+
+            if (previous)
+                if (!SetFATLink(previous, cluster)) // link the new cluster to the chain
+                    return(0);
+
+            return(cluster);
+        }
+
+        if (++cluster >= cluster_count)
+            cluster = 2;
+    }
+    while (cluster != start);
+
+    printf("AllocateCluster(): no free cluster!\r");
+    return(0);
+}
+
+// clusters are not allocated here - when the file grows the caller has to append them with AllocateCluster()
+// shrinking to fewer clusters is not supported (they would not be released)
 unsigned char UpdateEntry(fileTYPE *file)
 {
     DIRENTRY *pEntry;
@@ -1261,7 +1416,7 @@ unsigned char UpdateEntry(fileTYPE *file)
     memcpy((void*)pEntry->Name, file->name, 11);
     pEntry->Attributes = file->attributes;
 
-    if ((pEntry->FileSize + cluster_size - 1) / (cluster_size << 9) != (file->size + cluster_size - 1) / (cluster_size << 9))
+    if ((pEntry->FileSize + (cluster_size << 9) - 1) / (cluster_size << 9) > (file->size + (cluster_size << 9) - 1) / (cluster_size << 9))
     {
         printf("UpdateEntry(): different number of clusters!\r");
         printf("pEntry->FileSize = %lu\r", pEntry->FileSize);
@@ -61,10 +61,12 @@ typedef union {
 
 // global sector buffer, data for read/write actions is stored here.
 // BEWARE, this buffer is also used and thus trashed by all other functions
-extern unsigned char sector_buffer[512]; // sector buffer
+extern unsigned char sector_buffer[512] __attribute__((aligned(4))); // sector buffer
 extern unsigned char cluster_size;
 extern unsigned long cluster_mask;
+extern unsigned char cluster_shift;
 extern unsigned char fat32;
+extern unsigned long fat_reads;
 
 // constants
 #define DIRECTORY_ROOT 0
@@ -94,13 +96,18 @@ unsigned char FindDrive(void);
 unsigned long GetFATLink(unsigned long cluster);
 unsigned char FileNextSector(fileTYPE *file);
 unsigned char FileOpen(fileTYPE *file, char *name);
+unsigned char FileOpenDir(fileTYPE *file, char *name, unsigned long iDirectory);
 unsigned char FileSeek(fileTYPE *file, unsigned long offset, unsigned long origin);
 unsigned char FileRead(fileTYPE *file, unsigned char *pBuffer);
 unsigned char FileWrite(fileTYPE *file, unsigned char *pBuffer);
 unsigned char FileReadEx(fileTYPE *file, unsigned char *pBuffer, unsigned long nSize);
+unsigned char FileWriteEx(fileTYPE *file, unsigned char *pBuffer, unsigned long nSize);
 
 unsigned char FileCreate(unsigned long iDirectory, fileTYPE *file);
 unsigned char UpdateEntry(fileTYPE *file);
+unsigned char FlushFAT(void);
+unsigned char SetFATLink(unsigned long cluster, unsigned long link);
+unsigned long AllocateCluster(unsigned long previous);
 
 char ScanDirectory(unsigned long mode, char *extension, unsigned char options);
 void ChangeDirectory(unsigned long iStartCluster);
@@ -22,6 +22,21 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 // 2009-12-24   - updated sync word list
 //              - fixed sector header generation
 // 2010-01-09   - support for variable number of tracks
+// 2010-09-19   - own file structure (floppy requests may be served during other file operations)
+// 2010-09-20   - cache of encoded track sectors, re-read tracks are sent without card access and encoding
+// 2010-09-21   - 32-bit data field encoding and checksum, encoded sectors are sent by SPI PDC
+// 2010-09-22   - cached sectors and the gap are sent in one PDC burst as long as they fit into the FPGA FIFO
+// 2010-09-23   - normal floppy speed is forced for loaders depending on real disk timing
+// 2010-09-24   - written track data is read from the FPGA FIFO by SPI PDC and decoded 4 bytes at once
+// 2010-09-25   - written sectors are buffered and written to the card when the head moves, the disk is ejected or after a delay
+// 2010-09-26   - the track following in the head step direction is read ahead into the track buffer during idle time
+// 2010-09-27   - track data is sent up to the remaining dma length, transfers are continued from the same byte of the track
+// 2010-09-28   - disk sets: track indexes of all disks are built on insertion, disks are changed with Ctrl+LAlt+F1..F4
+// 2010-09-29   - LZ4 compressed ADF images (see TOOLS/lz4pack.c), tracks are decompressed into the track buffer
+// 2010-09-30   - extended ADF images (UAE-1ADF), raw MFM tracks are sent to the FPGA as they are
+// 2010-10-01   - start clusters of tracks are found on first access, index of a recently used disk is kept
+// 2010-10-02   - HD disk images (22 sectors per track), the track is encoded and cached in two halves of 11 sectors
+// 2010-10-07   - the other half of HD track is kept decoded in the track buffer, halves are swapped without card access
 
 #include "AT91SAM7S256.h"
 #include "stdio.h"
@@ -30,135 +45,359 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "hardware.h"
 #include "FAT.h"
 #include "FDD.h"
+#include "OSD.h"
+#include "config.h"
+#include "tasks.h"
+#include "LZ4.h"
 
 unsigned char DEBUG = 0;
 
 unsigned char drives = 0; // number of active drives reported by FPGA (may change only during reset)
-adfTYPE *pdfx;            // drive select pointer
+adfTYPE *pdfx;            // drive select pointer (drive of the last track request)
 adfTYPE df[4];            // drive 0 information structure
+unsigned char floppy_timing = 0; // loader depending on real disk timing found, normal speed is forced
 
-extern fileTYPE file;
+extern configTYPE config;
+
+fileTYPE fdd_file;        // file position of the track being transferred
+
+#define DISKSET_SIZE 4 // number of disks in a set (selected with Ctrl+LAlt+F1..F4)
+
+adfTYPE diskset[DISKSET_SIZE];   // disks of the set inserted last
+adfTYPE *diskset_drive = NULL;   // drive the disk set belongs to (NULL if there is no set)
+
+extern unsigned long iCurrentDirectory;
 
 #define TRACK_SIZE 12668
 #define HEADER_SIZE 0x40
 #define DATA_SIZE 0x400
 #define SECTOR_SIZE (HEADER_SIZE + DATA_SIZE)
-#define SECTOR_COUNT 11
+#define SECTOR_COUNT DD_SECTORS // HD tracks are handled as two halves of DD track size
 #define LAST_SECTOR (SECTOR_COUNT - 1)
 #define GAP_SIZE (TRACK_SIZE - SECTOR_COUNT * SECTOR_SIZE)
 
-// sends the data in the sector buffer to the FPGA, translated into an Amiga floppy format sector
+#define FIFO_SIZE 4096 // FPGA floppy FIFO size in bytes
+
+// LZ4 compressed ADF image (all values little endian):
+//   bytes 0-7      "MNMGADC1"
+//   bytes 8-9      number of tracks
+//   bytes 10-15    reserved
+//   bytes 16...    byte offsets of compressed tracks in the file, 32-bit entry per track
+//   following      LZ4 blocks, one per track (11 sectors)
+#define LZ4_ADF_ID "MNMGADC1"
+#define LZ4_ADF_HEADER_SIZE 16
+
+// extended ADF image (UAE-1ADF, all values big endian):
+//   bytes 0-7      "UAE-1ADF"
+//   bytes 8-9      reserved
+//   bytes 10-11    number of tracks
+//   bytes 12...    track headers, 12 bytes per track: reserved (2 bytes), type (2 bytes, 0: AmigaDOS sectors, 1: raw MFM),
+//                  space taken by the track data in the file (4 bytes), track length in bits (4 bytes)
+//   following      track data
+#define EXT_ADF_ID "UAE-1ADF"
+#define EXT_ADF_HEADER_SIZE 12
+#define EXT_ADF_RAW 0x80000000 // index cache flag of raw MFM track
+#define IMAGE_TRACK_CORRUPT 0x40000000 // index cache flag of compressed or extended image track which failed to load
+
+#define RAW_TRACK_SIZE 0x3400 // raw MFM tracks up to 13 KB (long tracks of copy protections)
+
+#define MFM_CACHE_TRACKS 1 // each cached track takes more than 12 KB
+
+// encoded track image, sectors followed by the gap (or raw MFM track of extended image)
+typedef struct
+{
+    adfTYPE       *drive;       /*drive the track belongs to (NULL if unused)*/
+    unsigned char track;        /*track number*/
+    unsigned char first;        /*first sector of the track (second half of HD track starts with sector 11)*/
+    unsigned short valid;       /*one bit per encoded sector*/
+    unsigned short dsksync;     /*sync word of encoded sectors*/
+    unsigned short size;        /*track length in bytes*/
+    unsigned long used;         /*last use (for replacement)*/
+    unsigned char data[RAW_TRACK_SIZE];
+} mfmtrackTYPE;
+
+void LoadRawTrack(adfTYPE *drive, mfmtrackTYPE *cache);
+
+mfmtrackTYPE mfm_cache[MFM_CACHE_TRACKS];
+unsigned long mfm_cache_time;
+
+#define WRITE_DELAY 1000 // time in ms after the last track write when the buffered sectors are written to the card
+
+// decoded sectors of the last written track or of the track read ahead
+typedef struct
+{
+    adfTYPE        *drive;      /*drive the buffered track belongs to (NULL if unused)*/
+    unsigned char  track;       /*track number*/
+    unsigned char  first;       /*first buffered sector (11 when the second half of HD track is buffered)*/
+    unsigned short valid;       /*one bit per buffered sector*/
+    unsigned short dirty;       /*one bit per changed sector*/
+    unsigned long  timeout;     /*time of the delayed write*/
+    unsigned char  data[SECTOR_COUNT][512];
+} trackbufferTYPE;
+
+trackbufferTYPE track_buffer;
+
+// mfm data of the track being written, a sector starting with its sync word is decoded in place
+unsigned char mfm_buffer[SECTOR_SIZE] __attribute__((aligned(4))); // decoded as 32-bit words
+unsigned short mfm_count; // number of bytes in the write buffer
+
+// translates the data in the sector buffer into an Amiga floppy format sector (SECTOR_SIZE bytes)
 // note that we do not insert clock bits because they will be stripped by the Amiga software anyway
-void SendSector(unsigned char *pData, unsigned char sector, unsigned char track, unsigned char dsksynch, unsigned char dsksyncl)
+// pMfm and pData must be word aligned, the data field is processed 4 bytes at once
+// gap is the number of sectors until the track gap (including this one)
+void EncodeSector(unsigned char *pMfm, unsigned char *pData, unsigned char sector, unsigned char track, unsigned char gap, unsigned char dsksynch, unsigned char dsksyncl)
 {
     unsigned char checksum[4];
     unsigned short i;
     unsigned char x;
-    unsigned char *p;
+    unsigned long *pw;
+    unsigned long *pd;
+    unsigned long sum;
 
     // preamble
-    SPI(0xAA);
-    SPI(0xAA);
-    SPI(0xAA);
-    SPI(0xAA);
+    *pMfm++ = 0xAA;
+    *pMfm++ = 0xAA;
+    *pMfm++ = 0xAA;
+    *pMfm++ = 0xAA;
 
     // synchronization
-    SPI(dsksynch);
-    SPI(dsksyncl);
-    SPI(dsksynch);
-    SPI(dsksyncl);
+    *pMfm++ = dsksynch;
+    *pMfm++ = dsksyncl;
+    *pMfm++ = dsksynch;
+    *pMfm++ = dsksyncl;
 
     // odd bits of header
     x = 0x55;
     checksum[0] = x;
-    SPI(x);
+    *pMfm++ = x;
     x = track >> 1 & 0x55;
     checksum[1] = x;
-    SPI(x);
+    *pMfm++ = x;
     x = sector >> 1 & 0x55;
     checksum[2] = x;
-    SPI(x);
-    x = 11 - sector >> 1 & 0x55;
+    *pMfm++ = x;
+    x = gap >> 1 & 0x55;
     checksum[3] = x;
-    SPI(x);
+    *pMfm++ = x;
 
     // even bits of header
     x = 0x55;
     checksum[0] ^= x;
-    SPI(x);
+    *pMfm++ = x;
     x = track & 0x55;
     checksum[1] ^= x;
-    SPI(x);
+    *pMfm++ = x;
     x = sector & 0x55;
     checksum[2] ^= x;
-    SPI(x);
-    x = 11 - sector & 0x55;
+    *pMfm++ = x;
+    x = gap & 0x55;
     checksum[3] ^= x;
-    SPI(x);
+    *pMfm++ = x;
 
     // sector label and reserved area (changes nothing to checksum)
     i = 0x20;
     while (i--)
-        SPI(0xAA);
-
-    // send header checksum
-    SPI(0xAA);
-    SPI(0xAA);
-    SPI(0xAA);
-    SPI(0xAA);
-    SPI(checksum[0] | 0xAA);
-    SPI(checksum[1] | 0xAA);
-    SPI(checksum[2] | 0xAA);
-    SPI(checksum[3] | 0xAA);
-
-    // calculate data checksum
-    checksum[0] = 0;
-    checksum[1] = 0;
-    checksum[2] = 0;
-    checksum[3] = 0;
-
-    p = pData;
+        *pMfm++ = 0xAA;
+
+    // header checksum
+    *pMfm++ = 0xAA;
+    *pMfm++ = 0xAA;
+    *pMfm++ = 0xAA;
+    *pMfm++ = 0xAA;
+    *pMfm++ = checksum[0] | 0xAA;
+    *pMfm++ = checksum[1] | 0xAA;
+    *pMfm++ = checksum[2] | 0xAA;
+    *pMfm++ = checksum[3] | 0xAA;
+
+    // data checksum is the XOR of odd and even bits of all longwords
+    // XOR is linear so the odd/even bit merge can be done once on the XOR of all data words
+    // only data bit positions (0x55) are used, bit 7 of each byte gets a clock bit
+    sum = 0;
+    pd = (unsigned long*)pData;
     i = DATA_SIZE / 2 / 4;
     while (i--)
-    {
-        x = *p++;
-        checksum[0] ^= x ^ x >> 1;
-        x = *p++;
-        checksum[1] ^= x ^ x >> 1;
-        x = *p++;
-        checksum[2] ^= x ^ x >> 1;
-        x = *p++;
-        checksum[3] ^= x ^ x >> 1;
-    }
-
-    // send data checksum
-    SPI(0xAA);
-    SPI(0xAA);
-    SPI(0xAA);
-    SPI(0xAA);
-    SPI(checksum[0] | 0xAA);
-    SPI(checksum[1] | 0xAA);
-    SPI(checksum[2] | 0xAA);
-    SPI(checksum[3] | 0xAA);
-
-    // odd bits of data field
-    i = DATA_SIZE / 2;
-    p = pData;
+        sum ^= *pd++;
+    sum ^= sum >> 1;
+
+    pw = (unsigned long*)pMfm; // data checksum starts at word aligned offset 0x38 of the sector
+    *pw++ = 0xAAAAAAAA;
+    *pw++ = sum | 0xAAAAAAAA;
+
+    // odd bits of data field (bit 0 of the next byte shifted into bit 7 is covered by a clock bit)
+    i = DATA_SIZE / 2 / 4;
+    pd = (unsigned long*)pData;
     while (i--)
-        SPI(*p++ >> 1 | 0xAA);
+        *pw++ = *pd++ >> 1 | 0xAAAAAAAA;
 
     // even bits of data field
-    i = DATA_SIZE / 2;
-    p = pData;
+    i = DATA_SIZE / 2 / 4;
+    pd = (unsigned long*)pData;
     while (i--)
-        SPI(*p++ | 0xAA);
+        *pw++ = *pd++ | 0xAAAAAAAA;
 }
 
-void SendGap(void)
+// translates the data field of an encoded sector back into sector data (clock bits are dropped)
+void DecodeSector(unsigned char *pData, unsigned char *pMfm)
 {
-    unsigned short i = GAP_SIZE;
+    unsigned long *p = (unsigned long*)&pMfm[HEADER_SIZE];
+    unsigned long *pd = (unsigned long*)pData;
+    unsigned short i = DATA_SIZE / 2 / 4;
+
     while (i--)
-        SPI(0xAA);
+    {
+        *pd++ = ((p[0] & 0x55555555) << 1) | (p[DATA_SIZE / 2 / 4] & 0x55555555);
+        p++;
+    }
+}
+
+void SetTrackSync(mfmtrackTYPE *cache, unsigned short dsksync)
+{
+    // changes sync words of already encoded sectors
+    unsigned char sector;
+    unsigned char *p;
+
+    if (cache->dsksync != dsksync)
+    {
+        for (sector = 0; sector < SECTOR_COUNT; sector++)
+        {
+            if (cache->valid & 1 << sector)
+            {
+                p = &cache->data[sector * SECTOR_SIZE + 4];
+                *p++ = (unsigned char)(dsksync >> 8);
+                *p++ = (unsigned char)dsksync;
+                *p++ = (unsigned char)(dsksync >> 8);
+                *p++ = (unsigned char)dsksync;
+            }
+        }
+        cache->dsksync = dsksync;
+    }
+}
+
+unsigned short SendTrackData(mfmtrackTYPE *cache, unsigned short offset, unsigned short size)
+{
+    // sends encoded track data starting at the given byte offset in a single SPI PDC transfer (DMA transfer)
+    // the transfer is limited to the given size, free FIFO space, the first sector which is not encoded yet and the end of the track
+    // the sector at the given offset must be already encoded
+    // returns the number of sent bytes
+    unsigned char *p = &cache->data[offset];
+    unsigned short fifo;
+    unsigned short end;
+    unsigned char sector;
+
+    // FIFO level (in words) is received during the first data word
+    fifo  = SPI(*p++) << 8 & 0x0F00;
+    fifo |= SPI(*p++);
+    fifo = FIFO_SIZE - (fifo << 1); // free space in bytes (at least half of the FIFO when read request is active)
+
+    if (size > fifo)
+        size = fifo;
+
+    // following sectors are added as long as they are already encoded, the gap after the last sector always is
+    sector = offset / SECTOR_SIZE;
+    while (++sector < SECTOR_COUNT && cache->valid & 1 << sector);
+    end = sector < SECTOR_COUNT ? sector * SECTOR_SIZE : cache->size;
+
+    if (size > end - offset)
+        size = end - offset;
+
+    if (size > 2)
+    {
+        // the rest is sent by SPI PDC, received data is discarded
+        *AT91C_SPI_TPR = (unsigned long)p;
+        *AT91C_SPI_TCR = size - 2;
+        *AT91C_SPI_TNCR = 0;
+        *AT91C_SPI_PTCR = AT91C_PDC_TXTEN; // start DMA transfer
+        while (!(*AT91C_SPI_SR & AT91C_SPI_ENDTX)); // wait for tranfer end
+        *AT91C_SPI_PTCR = AT91C_PDC_TXTDIS; // disable transmitter
+        SPI_Wait4XferEnd(); // last byte must be shifted out before SPI() reads the next one
+    }
+    else
+        size = 2;
+
+    return(size);
+}
+
+void SwapTrackHalf(mfmtrackTYPE *cache, unsigned char first)
+{
+    // exchanges the cached half of HD track with the other half kept decoded in the track buffer
+    // sectors of the cached half are decoded into the track buffer, buffered sectors of the requested half are encoded in their place
+    // (HD images are read only, the track buffer never holds written sectors of HD track)
+    unsigned short valid = 0;
+    unsigned short buffered = 0;
+    unsigned char sector;
+
+    if (track_buffer.drive == cache->drive && track_buffer.track == cache->track && track_buffer.first == first)
+        buffered = track_buffer.valid;
+    else
+    {
+        FlushTrackBuffer(); // written sectors of other track are stored
+        track_buffer.drive = cache->drive;
+        track_buffer.track = cache->track;
+    }
+
+    for (sector = 0; sector < SECTOR_COUNT; sector++)
+    {
+        if (buffered & 1 << sector)
+            memcpy(sector_buffer, track_buffer.data[sector], 512);
+
+        if (cache->valid & 1 << sector)
+        {
+            DecodeSector(track_buffer.data[sector], &cache->data[sector * SECTOR_SIZE]);
+            valid |= 1 << sector;
+        }
+
+        if (buffered & 1 << sector)
+            EncodeSector(&cache->data[sector * SECTOR_SIZE], sector_buffer, first + sector, cache->track, SECTOR_COUNT - sector, (unsigned char)(cache->dsksync >> 8), (unsigned char)cache->dsksync);
+    }
+
+    track_buffer.first = cache->first;
+    track_buffer.valid = valid;
+    cache->first = first;
+    cache->valid = buffered;
+}
+
+mfmtrackTYPE *GetTrackCache(adfTYPE *drive, unsigned char track, unsigned char first)
+{
+    // returns cache slot of the track (or half of HD track starting with the given sector)
+    // the least recently used slot is taken over if the track is not cached
+    mfmtrackTYPE *slot = mfm_cache;
+    unsigned char i;
+
+    for (i = 0; i < MFM_CACHE_TRACKS; i++)
+    {
+        if (mfm_cache[i].drive == drive && mfm_cache[i].track == track && mfm_cache[i].first == first)
+        {
+            slot = &mfm_cache[i];
+            break;
+        }
+        if (mfm_cache[i].used < slot->used)
+            slot = &mfm_cache[i];
+    }
+
+    if (slot->drive == drive && slot->track == track && slot->first != first)
+        SwapTrackHalf(slot, first); // other half of the same HD track
+    else if (slot->drive != drive || slot->track != track)
+    {
+        slot->drive = drive;
+        slot->track = track;
+        slot->first = first;
+        slot->valid = 0;
+        slot->size = TRACK_SIZE;
+        memset(&slot->data[SECTOR_COUNT * SECTOR_SIZE], 0xAA, GAP_SIZE);
+    }
+    slot->used = ++mfm_cache_time;
+
+    return(slot);
+}
+
+void InvalidateTrackCache(adfTYPE *drive)
+{
+    // drops all cached tracks of the drive (disk change or track write)
+    unsigned char i;
+
+    for (i = 0; i < MFM_CACHE_TRACKS; i++)
+        if (mfm_cache[i].drive == drive)
+            mfm_cache[i].drive = NULL;
 }
 
 // read a track from disk
@@ -170,7 +409,12 @@ void ReadTrack(adfTYPE *drive)
     unsigned char track;
     unsigned short dsksync;
     unsigned short dsklen;
-    //unsigned short n;
+    mfmtrackTYPE *cache;
+    unsigned short offset;
+    unsigned short size = 0;
+    unsigned char first;
+    unsigned char i;
+    unsigned char raw;
 
     if (drive->track >= drive->tracks)
     {
@@ -186,18 +430,9 @@ void ReadTrack(adfTYPE *drive)
     if (drive->track != drive->track_prev)
     { // track step or track 0, start at beginning of track
         drive->track_prev = drive->track;
-        sector = 0;
-        file.cluster = drive->cache[drive->track];
-        file.sector = drive->track * SECTOR_COUNT;
-        drive->sector_offset = sector;
-        drive->cluster_offset = file.cluster;
-    }
-    else
-    { // same track, start at next sector in track
-        sector = drive->sector_offset;
-        file.cluster = drive->cluster_offset;
-        file.sector = (drive->track * SECTOR_COUNT) + sector;
+        drive->track_offset = 0;
     }
+    // same track, continue from the byte where the previous transfer has stopped
 
     EnableFpga();
     status   = SPI(0); // read request signal
@@ -214,9 +449,45 @@ void ReadTrack(adfTYPE *drive)
     if (DEBUG)
         printf("(%u)[%04X]:", status >> 6, dsksync);
 
+    CheckFloppyTiming(drive, dsksync, dsklen);
+
+    raw = drive->format == ADF_EXTENDED && drive->cache[drive->track] & EXT_ADF_RAW;
+
     while (1)
     {
-        FileRead(&file, sector_buffer);
+        // HD track is sent as two DD track sized halves, each one followed by a gap
+        first = drive->sectors > SECTOR_COUNT && drive->track_offset >= TRACK_SIZE ? SECTOR_COUNT : 0;
+        offset = first ? drive->track_offset - TRACK_SIZE : drive->track_offset;
+
+        cache = GetTrackCache(drive, drive->track, first);
+        if (raw && !cache->valid)
+            LoadRawTrack(drive, cache);
+
+        if (offset >= cache->size)
+            offset = drive->track_offset = 0;
+
+        sector = offset / SECTOR_SIZE; // SECTOR_COUNT when in the gap
+
+        if (sector < SECTOR_COUNT && !(cache->valid & 1 << sector)) // sector not encoded yet
+        {
+            if (drive->format != ADF_STANDARD) // the whole track of a compressed or extended image is loaded into the track buffer
+                LoadImageTrack(drive, drive->track);
+
+            if (track_buffer.drive == drive && track_buffer.track == drive->track && track_buffer.first == first && track_buffer.valid & 1 << sector)
+                memcpy(sector_buffer, track_buffer.data[sector], 512); // sector read ahead or written but not yet stored on the card
+            else if (drive->format != ADF_STANDARD)
+                memset(sector_buffer, 0, 512); // corrupted compressed track or read error
+            else
+            {
+                // setting file pointer to the sector
+                fdd_file.cluster = GetTrackCluster(drive, drive->track);
+                fdd_file.sector = drive->track * drive->sectors;
+                for (i = 0; i < first + sector; i++)
+                    FileNextSector(&fdd_file);
+
+                FileRead(&fdd_file, sector_buffer);
+            }
+        }
 
         EnableFpga();
 
@@ -241,7 +512,7 @@ void ReadTrack(adfTYPE *drive)
         // Commando: $A245
 
         if (DEBUG)
-            printf("%X:%04X", sector, dsklen);
+            printf("%04X:%04X", drive->track_offset, dsklen);
 
         // some loaders stop dma if sector header isn't what they expect
         // because we don't check dma transfer count after sending a word
@@ -249,15 +520,18 @@ void ReadTrack(adfTYPE *drive)
         // in this case let's start transfer from the beginning
         if (track == drive->track)
         {
-            // send sector if fpga is still asking for data
+            // send data if fpga is still asking for it, no more than the remaining dma length
+            // (words preceding the sync word are dropped by the FPGA if the Amiga waits for it, the rest is sent in the next pass)
             if (status & CMD_RDTRK)
             {
-                //GenerateHeader(sector_header, sector_buffer, sector, track, dsksync);
-                //SendSector(sector_header, sector_buffer);
-                SendSector(sector_buffer, sector, track, (unsigned char)(dsksync >> 8), (unsigned char)dsksync);
-
-                if (sector == LAST_SECTOR)
-                    SendGap();
+                if (!raw) // raw tracks are sent as they are
+                    SetTrackSync(cache, dsksync);
+                if (sector < SECTOR_COUNT && !(cache->valid & 1 << sector))
+                {
+                    EncodeSector(&cache->data[sector * SECTOR_SIZE], sector_buffer, first + sector, track, SECTOR_COUNT - sector, (unsigned char)(dsksync >> 8), (unsigned char)dsksync);
+                    cache->valid |= 1 << sector;
+                }
+                size = SendTrackData(cache, offset, dsklen << 1);
             }
         }
 
@@ -272,21 +546,11 @@ void ReadTrack(adfTYPE *drive)
         if (!(status & CMD_RDTRK))
             break;
 
-        sector++;
-        if (sector < SECTOR_COUNT)
-        {
-            FileNextSector(&file);
-        }
-        else // go to the start of current track
-        {
-            sector = 0;
-            file.cluster = drive->cache[drive->track];
-            file.sector = drive->track * SECTOR_COUNT;
-        }
-
-        // remember current sector and cluster
-        drive->sector_offset = sector;
-        drive->cluster_offset = file.cluster;
+        // advance by the number of sent bytes, go to the start of current track after the gap
+        // (or to the second half of HD track after the gap following the first half)
+        drive->track_offset += size;
+        if (offset + size >= cache->size)
+            drive->track_offset = !first && drive->sectors > SECTOR_COUNT ? TRACK_SIZE : 0;
 
         if (DEBUG)
             printf("->");
@@ -295,13 +559,15 @@ void ReadTrack(adfTYPE *drive)
         printf(":OK\r");
 }
 
-unsigned char FindSync(adfTYPE *drive)
-// reads data from fifo till it finds sync word or fifo is empty and dma inactive (so no more data is expected)
+unsigned char FillWriteBuffer(adfTYPE *drive, unsigned short size)
+// reads mfm data written by the Amiga from the fifo till there are at least size bytes in the write buffer
+// all data available in the fifo is read in one SPI PDC transfer (DMA transfer) as long as it fits into the buffer
+// returns 0 if the buffer can't be filled (fifo is empty and write dma is inactive or write request is gone)
 {
     unsigned char  c1, c2, c3, c4;
     unsigned short n;
 
-    while (1)
+    while (mfm_count < size)
     {
         EnableFpga();
         c1 = SPI(0); // write request signal
@@ -312,303 +578,213 @@ unsigned char FindSync(adfTYPE *drive)
             break;
         SPI(0); // disk sync high byte
         SPI(0); // disk sync low byte
-        c3 = SPI(0) & 0xBF; // msb of mfm words to transfer
-        c4 = SPI(0); // lsb of mfm words to transfer
+        c3 = SPI(0); // msb of mfm words in fifo (bit 7: write dma active)
+        c4 = SPI(0); // lsb of mfm words in fifo
+
+        n = (((c3 & 0x3F) << 8) + c4) << 1; // bytes in fifo
+        if (n > sizeof(mfm_buffer) - mfm_count)
+            n = sizeof(mfm_buffer) - mfm_count;
 
-        if (c3 == 0 && c4 == 0)
+        if (n)
+        {
+            // transmitted data is ignored by the FPGA during track write
+            *AT91C_SPI_RPR = (unsigned long)&mfm_buffer[mfm_count];
+            *AT91C_SPI_RCR = n;
+            *AT91C_SPI_TPR = (unsigned long)&mfm_buffer[mfm_count];
+            *AT91C_SPI_TCR = n;
+            *AT91C_SPI_PTCR = AT91C_PDC_RXTEN | AT91C_PDC_TXTEN; // start DMA transfer
+            while (!(*AT91C_SPI_SR & AT91C_SPI_ENDRX)); // wait for tranfer end
+            *AT91C_SPI_PTCR = AT91C_PDC_RXTDIS | AT91C_PDC_TXTDIS; // disable transmitter and receiver
+            mfm_count += n;
+        }
+        else if ((c3 & 0x80) == 0) // fifo is empty and write dma is not active
             break;
 
-        n = ((c3 & 0x3F) << 8) + c4;
+        DisableFpga();
+    }
+    DisableFpga();
+
+    return(mfm_count >= size);
+}
+
+void DropWriteBuffer(unsigned short size)
+// removes processed data from the beginning of the write buffer
+{
+    if (size > mfm_count)
+        size = mfm_count;
 
+    mfm_count -= size;
+    memmove(mfm_buffer, &mfm_buffer[size], mfm_count);
+}
+
+unsigned char FindSync(adfTYPE *drive)
+// reads data from fifo till it finds sync word or fifo is empty and dma inactive (so no more data is expected)
+// the sync word is moved to the beginning of the write buffer so the rest of the sector is word aligned
+{
+    unsigned short *p;
+    unsigned short n;
+
+    while (FillWriteBuffer(drive, 2))
+    {
+        // mfm words are always received as pairs of bytes so the sync word can only be found at even offsets
+        p = (unsigned short*)mfm_buffer;
+        n = mfm_count >> 1;
         while (n--)
         {
-            c3 = SPI(0);
-            c4 = SPI(0);
-            if (c3 == 0x44 && c4 == 0x89)
+            if (*p++ == 0x8944) // 0x4489 in big endian order
             {
-                DisableFpga();
+                DropWriteBuffer((unsigned char*)p - mfm_buffer - 2);
                 if (DEBUG)
                     printf("#SYNC:");
 
                 return 1;
             }
         }
-        DisableFpga();
+        mfm_count = 0;
     }
-    DisableFpga();
     return 0;
 }
 
-unsigned char GetHeader(unsigned char *pTrack, unsigned char *pSector)
-// this function reads data from fifo till it finds sync word or dma is inactive
+unsigned char GetHeader(adfTYPE *drive, unsigned char *pTrack, unsigned char *pSector)
+// decodes sector header following the sync word at the beginning of the write buffer
 {
-    unsigned char c, c1, c2, c3, c4;
+    unsigned long *p;
+    unsigned long info;
+    unsigned long checksum;
     unsigned char i;
-    unsigned char checksum[4];
 
     Error = 0;
-    while (1)
+    if (!FillWriteBuffer(drive, HEADER_SIZE - 12)) // second sync word, header info, label and header checksum
     {
-        EnableFpga();
-        c1 = SPI(0); // write request signal
-        c2 = SPI(0); // track number (cylinder & head)
-        if (!(c1 & CMD_WRTRK))
-            break;
-        SPI(0); // disk sync high byte
-        SPI(0); // disk sync low byte
-        c3 = SPI(0); // msb of mfm words to transfer
-        c4 = SPI(0); // lsb of mfm words to transfer
-
-        if ((c3 & 0x3F) != 0 || c4 > 24)// remaining header data is 25 mfm words
-        {
-            c1 = SPI(0); // second sync lsb
-            c2 = SPI(0); // second sync msb
-            if (c1 != 0x44 || c2 != 0x89)
-            {
-                Error = 21;
-                printf("\rSecond sync word missing...\r");
-                break;
-            }
-
-            c = SPI(0);
-            checksum[0] = c;
-            c1 = (c & 0x55) << 1;
-            c = SPI(0);
-            checksum[1] = c;
-            c2 = (c & 0x55) << 1;
-            c = SPI(0);
-            checksum[2] = c;
-            c3 = (c & 0x55) << 1;
-            c = SPI(0);
-            checksum[3] = c;
-            c4 = (c & 0x55) << 1;
-
-            c = SPI(0);
-            checksum[0] ^= c;
-            c1 |= c & 0x55;
-            c = SPI(0);
-            checksum[1] ^= c;
-            c2 |= c & 0x55;
-            c = SPI(0);
-            checksum[2] ^= c;
-            c3 |= c & 0x55;
-            c = SPI(0);
-            checksum[3] ^= c;
-            c4 |= c & 0x55;
-
-            if (c1 != 0xFF) // always 0xFF
-                Error = 22;
-            else if (c2 > 159) // Track number (0-159)
-                Error = 23;
-            else if (c3 > 10) // Sector number (0-10)
-                Error = 24;
-            else if (c4 > 11 || c4 == 0) // Number of sectors to gap (1-11)
-                Error = 25;
-
-            if (Error)
-            {
-                printf("\rWrong header: %u.%u.%u.%u\r", c1, c2, c3, c4);
-                break;
-            }
-
-            if (DEBUG)
-                printf("T%uS%u\r", c2, c3);
-
-            *pTrack = c2;
-            *pSector = c3;
-
-            for (i = 0; i < 8; i++)
-            {
-                checksum[0] ^= SPI(0);
-                checksum[1] ^= SPI(0);
-                checksum[2] ^= SPI(0);
-                checksum[3] ^= SPI(0);
-            }
-
-            checksum[0] &= 0x55;
-            checksum[1] &= 0x55;
-            checksum[2] &= 0x55;
-            checksum[3] &= 0x55;
+        Error = 20; // not enough data for header and write dma is not active
+        return 0;
+    }
 
-            c1 = (SPI(0) & 0x55) << 1;
-            c2 = (SPI(0) & 0x55) << 1;
-            c3 = (SPI(0) & 0x55) << 1;
-            c4 = (SPI(0) & 0x55) << 1;
+    if (mfm_buffer[2] != 0x44 || mfm_buffer[3] != 0x89)
+    {
+        Error = 21;
+        printf("\rSecond sync word missing...\r");
+        return 0;
+    }
 
-            c1 |= SPI(0) & 0x55;
-            c2 |= SPI(0) & 0x55;
-            c3 |= SPI(0) & 0x55;
-            c4 |= SPI(0) & 0x55;
+    // odd and even bits of every byte are merged 4 bytes at once
+    p = (unsigned long*)&mfm_buffer[4];
+    info = ((p[0] & 0x55555555) << 1) | (p[1] & 0x55555555);
+
+    checksum = 0;
+    for (i = 0; i < 10; i++) // header info and sector label
+        checksum ^= *p++;
+    checksum &= 0x55555555;
+
+    // byte order of the decoded longword is the same as of the mfm data
+    if (((unsigned char*)&info)[0] != 0xFF) // always 0xFF
+        Error = 22;
+    else if (((unsigned char*)&info)[1] > 159) // Track number (0-159)
+        Error = 23;
+    else if (((unsigned char*)&info)[2] > 10) // Sector number (0-10)
+        Error = 24;
+    else if (((unsigned char*)&info)[3] > 11 || ((unsigned char*)&info)[3] == 0) // Number of sectors to gap (1-11)
+        Error = 25;
+
+    if (Error)
+    {
+        printf("\rWrong header: %u.%u.%u.%u\r", ((unsigned char*)&info)[0], ((unsigned char*)&info)[1], ((unsigned char*)&info)[2], ((unsigned char*)&info)[3]);
+        return 0;
+    }
 
-            if (c1 != checksum[0] || c2 != checksum[1] || c3 != checksum[2] || c4 != checksum[3])
-            {
-                Error = 26;
-                break;
-            }
+    if (DEBUG)
+        printf("T%uS%u\r", ((unsigned char*)&info)[1], ((unsigned char*)&info)[2]);
 
-            DisableFpga();
-            return 1;
-        }
-        else if ((c3 & 0x80) == 0) // not enough data for header and write dma is not active
-        {
-            Error = 20;
-            break;
-        }
+    *pTrack = ((unsigned char*)&info)[1];
+    *pSector = ((unsigned char*)&info)[2];
 
-        DisableFpga();
+    if (checksum != (((p[0] & 0x55555555) << 1) | (p[1] & 0x55555555)))
+    {
+        Error = 26;
+        return 0;
     }
 
-    DisableFpga();
-    return 0;
+    return 1;
 }
 
-unsigned char GetData(void)
+unsigned char GetData(adfTYPE *drive)
+// decodes data field of the sector at the beginning of the write buffer into the sector buffer
 {
-    unsigned char c, c1, c2, c3, c4;
-    unsigned char i;
-    unsigned char *p;
-    unsigned short n;
-    unsigned char checksum[4];
+    unsigned long *p;
+    unsigned long *pd;
+    unsigned long checksum;
+    unsigned long c;
+    unsigned short i;
 
     Error = 0;
-    while (1)
+    if (!FillWriteBuffer(drive, SECTOR_SIZE - 4)) // the whole sector without the preamble
     {
-        EnableFpga();
-        c1 = SPI(0); // write request signal
-        c2 = SPI(0); // track number (cylinder & head)
-        if (!(c1 & CMD_WRTRK))
-            break;
-        SPI(0); // disk sync high byte
-        SPI(0); // disk sync low byte
-        c3 = SPI(0); // msb of mfm words to transfer
-        c4 = SPI(0); // lsb of mfm words to transfer
-
-        n = ((c3 & 0x3F) << 8) + c4;
-
-        if (n >= 0x204)
-        {
-            c1 = (SPI(0) & 0x55) << 1;
-            c2 = (SPI(0) & 0x55) << 1;
-            c3 = (SPI(0) & 0x55) << 1;
-            c4 = (SPI(0) & 0x55) << 1;
-
-            c1 |= SPI(0) & 0x55;
-            c2 |= SPI(0) & 0x55;
-            c3 |= SPI(0) & 0x55;
-            c4 |= SPI(0) & 0x55;
-
-            checksum[0] = 0;
-            checksum[1] = 0;
-            checksum[2] = 0;
-            checksum[3] = 0;
-
-            // odd bits of data field
-            i = 128;
-            p = sector_buffer;
-            do
-            {
-                c = SPI(0);
-                checksum[0] ^= c;
-                *p++ = (c & 0x55) << 1;
-                c = SPI(0);
-                checksum[1] ^= c;
-                *p++ = (c & 0x55) << 1;
-                c = SPI(0);
-                checksum[2] ^= c;
-                *p++ = (c & 0x55) << 1;
-                c = SPI(0);
-                checksum[3] ^= c;
-                *p++ = (c & 0x55) << 1;
-            }
-            while (--i);
-
-            // even bits of data field
-            i = 128;
-            p = sector_buffer;
-            do
-            {
-                c = SPI(0);
-                checksum[0] ^= c;
-                *p++ |= c & 0x55;
-                c = SPI(0);
-                checksum[1] ^= c;
-                *p++ |= c & 0x55;
-                c = SPI(0);
-                checksum[2] ^= c;
-                *p++ |= c & 0x55;
-                c = SPI(0);
-                checksum[3] ^= c;
-                *p++ |= c & 0x55;
-            }
-            while (--i);
-
-            checksum[0] &= 0x55;
-            checksum[1] &= 0x55;
-            checksum[2] &= 0x55;
-            checksum[3] &= 0x55;
+        Error = 28; // not enough data in fifo and write dma is not active
+        return 0;
+    }
 
-            if (c1 != checksum[0] || c2 != checksum[1] || c3 != checksum[2] || c4 != checksum[3])
-            {
-                Error = 29;
-                break;
-            }
+    // data checksum
+    p = (unsigned long*)&mfm_buffer[HEADER_SIZE - 12];
+    c = ((p[0] & 0x55555555) << 1) | (p[1] & 0x55555555);
+    p += 2;
 
-            DisableFpga();
-            return 1;
-        }
-        else if ((c3 & 0x80) == 0) // not enough data in fifo and write dma is not active
-        {
-            Error = 28;
-            break;
-        }
+    // odd and even bits of the data field are merged 4 bytes at once
+    checksum = 0;
+    pd = (unsigned long*)sector_buffer;
+    i = DATA_SIZE / 2 / 4;
+    do
+    {
+        checksum ^= p[0] ^ p[DATA_SIZE / 2 / 4];
+        *pd++ = ((p[0] & 0x55555555) << 1) | (p[DATA_SIZE / 2 / 4] & 0x55555555);
+        p++;
+    }
+    while (--i);
 
-        DisableFpga();
+    if (c != (checksum & 0x55555555))
+    {
+        Error = 29;
+        return 0;
     }
-    DisableFpga();
-    return 0;
+
+    return 1;
 }
 
 void WriteTrack(adfTYPE *drive)
 {
-    unsigned char sector;
     unsigned char Track;
     unsigned char Sector;
 
-    // setting file pointer to begining of current track
-    file.cluster = drive->cache[drive->track];
-    file.sector = drive->track * 11;
-    sector = 0;
-
     drive->track_prev = drive->track + 1; // just to force next read from the start of current track
 
+    InvalidateTrackCache(drive);
+    mfm_count = 0;
+
+    if (track_buffer.drive != drive || track_buffer.track != drive->track)
+    { // other track is buffered
+        FlushTrackBuffer(); // written sectors are stored, sectors read ahead are dropped
+        track_buffer.drive = drive;
+        track_buffer.track = drive->track;
+        track_buffer.first = 0;
+    }
+
     if (DEBUG)
         printf("*%u:\r", drive->track);
 
+    // sectors may come in any order, each one is stored at its place in the track buffer
     while (FindSync(drive))
     {
-        if (GetHeader(&Track, &Sector))
+        if (GetHeader(drive, &Track, &Sector))
         {
             if (Track == drive->track)
             {
-                while (sector != Sector)
+                if (GetData(drive))
                 {
-                    if (sector < Sector)
-                    {
-                        FileNextSector(&file);
-                        sector++;
-                    }
-                    else
+                    if (drive->status & DSK_WRITABLE)
                     {
-                        file.cluster = drive->cache[drive->track];
-                        file.sector = drive->track * 11;
-                        sector = 0;
+                        memcpy(track_buffer.data[Sector], sector_buffer, 512);
+                        track_buffer.valid |= 1 << Sector;
+                        track_buffer.dirty |= 1 << Sector;
                     }
-                }
-
-                if (GetData())
-                {
-                    if (drive->status & DSK_WRITABLE)
-                        FileWrite(&file, sector_buffer);
                     else
                     {
                         Error = 30;
@@ -618,19 +794,516 @@ void WriteTrack(adfTYPE *drive)
             }
             else
                 Error = 27; //track number reported in sector header is not the same as current drive track
+
+            DropWriteBuffer(SECTOR_SIZE - 4); // skip decoded sector
         }
+        else
+            DropWriteBuffer(4); // skip both sync words, a valid header may follow
         if (Error)
         {
             printf("WriteTrack: error %u\r", Error);
             ErrorMessage("  WriteTrack", Error);
         }
     }
+
+    track_buffer.timeout = GetTimer(WRITE_DELAY);
+}
+
+void FlushTrackBuffer(void)
+{
+    // writes changed sectors of the buffered track to the card, consecutive sectors are written with one multiple block write
+    adfTYPE *drive = track_buffer.drive;
+    fileTYPE file;
+    unsigned char sector;
+    unsigned char count;
+    unsigned char i;
+
+    if (!drive)
+        return;
+
+    sector = 0;
+    while (sector < SECTOR_COUNT)
+    {
+        if (track_buffer.dirty & 1 << sector)
+        {
+            count = 1;
+            while (sector + count < SECTOR_COUNT && track_buffer.dirty & 1 << (sector + count))
+                count++;
+
+            // setting file pointer to the first changed sector
+            file.cluster = GetTrackCluster(drive, track_buffer.track);
+            file.sector = track_buffer.track * SECTOR_COUNT;
+            for (i = 0; i < sector; i++)
+                FileNextSector(&file);
+
+            if (DEBUG)
+                printf("#%u:%u-%u\r", track_buffer.track, sector, sector + count - 1);
+
+            if (!FileWriteEx(&file, track_buffer.data[sector], count))
+            { // the buffer is released anyway, the user has to know the disk image is not up to date
+                printf("FlushTrackBuffer: write error (track %u, sector %u)\r", track_buffer.track, sector);
+                ErrorMessage("  FlushTrackBuffer", ERROR_UPDATE_FAILED);
+            }
+
+            sector += count;
+        }
+        else
+            sector++;
+    }
+
+    track_buffer.valid = 0;
+    track_buffer.dirty = 0;
+    track_buffer.drive = NULL;
+}
+
+unsigned char *GetTransferBuffer(void)
+{
+    // lends the track buffer (SECTOR_COUNT * 512 bytes) to file transfers done while no floppy requests are served
+    // (FPGA configuration and ROM upload), written sectors are stored first
+    FlushTrackBuffer();
+    track_buffer.valid = 0;
+    track_buffer.drive = NULL;
+
+    return(track_buffer.data[0]);
+}
+
+void PrefetchTrack(adfTYPE *drive)
+{
+    // reads sectors of the track the head is expected to step to next (the track buffer must not hold written sectors)
+    // floppy requests are served between sectors, reading stops if the buffer is taken over by a track write
+    fileTYPE file;
+    unsigned char track;
+    unsigned char sector;
+    unsigned char i;
+
+    track = drive->track + drive->step;
+    if (!(drive->status & DSK_INSERTED) || track >= drive->tracks) // no disk or no track in this direction
+        return;
+
+    // the current track may still be encoded from the track buffer, it must not be replaced before all its sectors are cached
+    // (a compressed track would be decompressed again for every FIFO burst)
+    for (i = 0; i < MFM_CACHE_TRACKS; i++)
+        if (mfm_cache[i].drive == drive && mfm_cache[i].track == drive->track && !mfm_cache[i].first && mfm_cache[i].valid == (1 << SECTOR_COUNT) - 1)
+            break;
+
+    if (i == MFM_CACHE_TRACKS)
+        return;
+
+    if (drive->sectors > SECTOR_COUNT) // HD track doesn't fit into the track buffer
+        return;
+
+    if (drive->format != ADF_STANDARD) // compressed or extended image
+    {
+        if (!(drive->format == ADF_EXTENDED && drive->cache[track] & EXT_ADF_RAW)) // raw tracks go to the encoded track cache only
+            LoadImageTrack(drive, track);
+        return;
+    }
+
+    if (track_buffer.drive != drive || track_buffer.track != track)
+    {
+        track_buffer.drive = drive;
+        track_buffer.track = track;
+        track_buffer.first = 0;
+        track_buffer.valid = 0;
+    }
+
+    file.cluster = GetTrackCluster(drive, track);
+    file.sector = track * SECTOR_COUNT;
+    sector = 0;
+    while (track_buffer.valid != (1 << SECTOR_COUNT) - 1)
+    {
+        if (!(track_buffer.valid & 1 << sector))
+        {
+            if (DEBUG)
+                printf("+%u:%u\r", track, sector);
+
+            FileRead(&file, track_buffer.data[sector]);
+            track_buffer.valid |= 1 << sector;
+
+            Yield(TASK_FDD);
+            if (track_buffer.drive != drive || track_buffer.track != track)
+                break;
+        }
+        if (sector < LAST_SECTOR)
+            FileNextSector(&file);
+        sector++;
+    }
+}
+
+void HandleFDDBackground(void)
+{
+    // buffered track is written to the card when the head of its drive moves or no other write comes in time
+    // otherwise the next track of the last accessed drive is read ahead
+    if (track_buffer.dirty)
+    {
+        if (track_buffer.drive->track != track_buffer.track || CheckTimer(track_buffer.timeout))
+            FlushTrackBuffer();
+    }
+    else if (pdfx)
+        PrefetchTrack(pdfx);
+}
+
+void CheckFloppyTiming(adfTYPE *drive, unsigned short dsksync, unsigned short dsklen)
+{
+    // custom sync words and reads longer than two revolutions are used by copy protections and custom loaders
+    // which measure track length or rely on the time it takes to read a track
+    if (config.floppy.speed != CONFIG_FLOPPY1X && !floppy_timing && (dsksync != 0x4489 || dsklen > drive->sectors / SECTOR_COUNT * TRACK_SIZE))
+    {
+        printf("Loader needs real disk timing (sync: %04X, length: %04X), floppy speed set to normal\r", dsksync, dsklen);
+        floppy_timing = 1;
+        ConfigFloppy(config.floppy.drives, CONFIG_FLOPPY1X);
+    }
+}
+
+void RestoreFloppySpeed(void)
+{
+    // user selected speed mode is restored on disk change
+    if (floppy_timing)
+    {
+        floppy_timing = 0;
+        ConfigFloppy(config.floppy.drives, config.floppy.speed);
+    }
+}
+
+void BuildTrackIndex(adfTYPE *drive, fileTYPE *file)
+{
+    // calculates number of tracks in the ADF image file, start clusters of tracks are found later on first access
+    // compressed and extended images hold the number of tracks in their headers, byte offsets of tracks are indexed
+    unsigned char i;
+    unsigned long tracks;
+    unsigned long offset;
+    unsigned char *p;
+    adfTYPE *recent;
+
+    // the same image was in the drive or is a disk of the current set
+    recent = NULL;
+    if (drive->start_cluster == file->start_cluster && drive->format == ADF_STANDARD && drive->cache[0] == file->start_cluster)
+        recent = drive;
+    for (i = 0; i < DISKSET_SIZE; i++)
+        if (diskset[i].status & DSK_INSERTED && diskset[i].format == ADF_STANDARD && diskset[i].start_cluster == file->start_cluster)
+            recent = &diskset[i];
+
+    drive->start_cluster = file->start_cluster;
+    drive->sectors = SECTOR_COUNT;
+
+    FileRead(file, sector_buffer);
+    if (strncmp((const char*)sector_buffer, LZ4_ADF_ID, 8) == 0)
+    {
+        drive->format = ADF_LZ4;
+        tracks = sector_buffer[8] | sector_buffer[9] << 8;
+        if (tracks > MAX_TRACKS)
+        {
+            printf("UNSUPPORTED ADF SIZE!!! Too many tracks: %lu\r", tracks);
+            tracks = MAX_TRACKS;
+        }
+        drive->tracks = (unsigned char)tracks;
+
+        p = &sector_buffer[LZ4_ADF_HEADER_SIZE];
+        for (i = 0; i < tracks; i++)
+        {
+            if (p == &sector_buffer[512]) // index continues in the next sector
+            {
+                FileNextSector(file);
+                FileRead(file, sector_buffer);
+                p = sector_buffer;
+            }
+            drive->cache[i] = p[0] | p[1] << 8 | p[2] << 16 | p[3] << 24;
+            p += 4;
+        }
+        printf("LZ4 compressed image\r");
+        return;
+    }
+
+    if (strncmp((const char*)sector_buffer, EXT_ADF_ID, 8) == 0)
+    {
+        drive->format = ADF_EXTENDED;
+        offset = sector_buffer[10] << 8 | sector_buffer[11]; // number of tracks in the file
+        tracks = offset;
+        if (tracks > MAX_TRACKS)
+        {
+            printf("UNSUPPORTED ADF SIZE!!! Too many tracks: %lu\r", tracks);
+            tracks = MAX_TRACKS;
+        }
+        drive->tracks = (unsigned char)tracks;
+
+        // track headers are read into the track buffer
+        FlushTrackBuffer();
+        ReadImage(drive, EXT_ADF_HEADER_SIZE, track_buffer.data[0], tracks * EXT_ADF_HEADER_SIZE);
+
+        offset = EXT_ADF_HEADER_SIZE + offset * EXT_ADF_HEADER_SIZE; // track data follows all headers
+        p = track_buffer.data[0];
+        for (i = 0; i < tracks; i++)
+        {
+            drive->cache[i] = offset;
+            if (p[2] << 8 | p[3]) // raw MFM track
+                drive->cache[i] |= EXT_ADF_RAW;
+            offset += (unsigned long)p[4] << 24 | (unsigned long)p[5] << 16 | p[6] << 8 | p[7];
+            p += EXT_ADF_HEADER_SIZE;
+        }
+        printf("Extended ADF image\r");
+        return;
+    }
+
+    drive->format = ADF_STANDARD;
+
+    if (file->size > MAX_TRACKS * SECTOR_COUNT * 512) // too big for DD disk
+    {
+        drive->sectors = HD_SECTORS;
+        printf("HD disk image\r");
+    }
+
+    tracks = file->size / (512 * drive->sectors);
+    if (tracks > MAX_TRACKS)
+    {
+        printf("UNSUPPORTED ADF SIZE!!! Too many tracks: %lu\r", tracks);
+        tracks = MAX_TRACKS;
+    }
+    drive->tracks = (unsigned char)tracks;
+
+    if (recent && recent->tracks == drive->tracks) // start clusters found so far are still valid
+    {
+        if (recent != drive)
+            memcpy(drive->cache, recent->cache, sizeof(drive->cache));
+        return;
+    }
+
+    memset(drive->cache, 0, sizeof(drive->cache));
+    drive->cache[0] = file->start_cluster;
+}
+
+unsigned long GetTrackCluster(adfTYPE *drive, unsigned char track)
+{
+    // returns start cluster of the track, unknown start clusters are found by following the cluster chain from the nearest known track
+    fileTYPE file;
+    unsigned char i, j;
+
+    i = track;
+    while (!drive->cache[i]) // start cluster of track 0 is always known
+        i--;
+
+    file.cluster = drive->cache[i];
+    file.sector = i * drive->sectors;
+    while (i < track)
+    {
+        for (j = 0; j < drive->sectors; j++)
+            FileNextSector(&file); // advance by track length
+        drive->cache[++i] = file.cluster;
+    }
+
+    return(drive->cache[track]);
+}
+
+unsigned char ReadImage(adfTYPE *drive, unsigned long offset, unsigned char *p, unsigned long size)
+{
+    // reads data from any byte offset of a compressed or extended image file
+    unsigned short n;
+
+    fdd_file.start_cluster = drive->start_cluster;
+    fdd_file.cluster = drive->start_cluster;
+    fdd_file.sector = 0;
+    if (!FileSeek(&fdd_file, offset >> 9, SEEK_SET))
+        return(0);
+
+    offset &= 0x1FF;
+    while (size)
+    {
+        if (!FileRead(&fdd_file, sector_buffer))
+            return(0);
+
+        n = 512 - offset;
+        if (n > size)
+            n = size;
+
+        memcpy(p, &sector_buffer[offset], n);
+        p += n;
+        size -= n;
+        offset = 0;
+
+        if (size)
+            FileNextSector(&fdd_file);
+    }
+    return(1);
+}
+
+void LoadImageTrack(adfTYPE *drive, unsigned char track)
+{
+    // loads the whole AmigaDOS track of a compressed or extended image into the track buffer (the buffer is not used on error)
+    unsigned short offset;
+    unsigned long time;
+    unsigned char ok;
+
+    if (track_buffer.drive == drive && track_buffer.track == track && track_buffer.valid == (1 << SECTOR_COUNT) - 1)
+        return;
+
+    if (drive->cache[track] & IMAGE_TRACK_CORRUPT) // already failed, sectors are sent empty
+        return;
+
+    FlushTrackBuffer(); // written sectors of other track are stored
+
+    time = GetTimer(0);
+
+    if (drive->format == ADF_LZ4)
+    {
+        fdd_file.start_cluster = drive->start_cluster;
+        fdd_file.cluster = drive->start_cluster;
+        fdd_file.sector = 0;
+        FileSeek(&fdd_file, drive->cache[track] >> 9, SEEK_SET);
+        offset = drive->cache[track] & 0x1FF;
+
+        ok = LZ4_Decompress(&fdd_file, &offset, track_buffer.data[0], SECTOR_COUNT * 512);
+    }
+    else
+        ok = ReadImage(drive, drive->cache[track], track_buffer.data[0], SECTOR_COUNT * 512);
+
+    if (ok)
+    {
+        track_buffer.drive = drive;
+        track_buffer.track = track;
+        track_buffer.first = 0;
+        track_buffer.valid = (1 << SECTOR_COUNT) - 1;
+    }
+    else
+    {
+        printf("Corrupted image track %u\r", track);
+        drive->cache[track] |= IMAGE_TRACK_CORRUPT; // not retried until the disk is inserted again
+    }
+
+    if (DEBUG)
+    {
+        time = GetTimer(0) - time;
+        printf("Z%u:%lu sectors, %lu ms\r", track, fdd_file.sector - (drive->cache[track] >> 9) + 1, time >> 20);
+    }
+}
+
+void LoadRawTrack(adfTYPE *drive, mfmtrackTYPE *cache)
+{
+    // reads raw MFM track of an extended image into the track cache, nothing has to be encoded
+    unsigned char header[EXT_ADF_HEADER_SIZE];
+    unsigned long size;
+
+    size = 0;
+    if (ReadImage(drive, EXT_ADF_HEADER_SIZE + cache->track * EXT_ADF_HEADER_SIZE, header, sizeof(header)))
+        size = (((unsigned long)header[8] << 24 | (unsigned long)header[9] << 16 | header[10] << 8 | header[11]) + 15) >> 4 << 1; // bits to bytes (whole mfm words)
+
+    if (size > RAW_TRACK_SIZE)
+    {
+        printf("Raw track %u too long (%lu bytes)\r", cache->track, size);
+        size = RAW_TRACK_SIZE;
+    }
+
+    if (!size || !ReadImage(drive, drive->cache[cache->track] & ~EXT_ADF_RAW, cache->data, size))
+    { // unformatted track or read error
+        memset(cache->data, 0xAA, TRACK_SIZE);
+        size = TRACK_SIZE;
+    }
+
+    if (DEBUG)
+        printf("R%u:%lu bytes\r", cache->track, size);
+
+    cache->size = (unsigned short)size;
+    cache->valid = (1 << SECTOR_COUNT) - 1;
+}
+
+void ScanDiskSet(adfTYPE *drive, fileTYPE *file)
+{
+    // looks for other disks of a set if the inserted file name ends with a disk number (GAME1.ADF ... GAME4.ADF)
+    // the disks must be in the same directory, their track indexes are built now so disk changes take no time
+    // (start clusters of tracks found while a disk of the set was used are kept)
+    fileTYPE set_file;
+    char name[11];
+    unsigned char i, n;
+    unsigned char count;
+
+    diskset_drive = NULL;
+
+    i = 8;
+    while (i && file->name[i - 1] == ' ') // last character of the base name
+        i--;
+
+    if (!i || file->name[i - 1] < '1' || file->name[i - 1] > '0' + DISKSET_SIZE)
+        return;
+
+    if (i > 1 && file->name[i - 2] == '~') // short name alias of a long name (SENSIB~1.ADF), the digit is not a disk number
+        return;
+
+    i--;
+    memcpy(name, file->name, sizeof(name));
+    count = 0;
+    for (n = 0; n < DISKSET_SIZE; n++)
+    {
+        name[i] = '1' + n;
+        if (name[i] == file->name[i]) // inserted disk
+            memcpy(&diskset[n], drive, sizeof(adfTYPE));
+        else if (FileOpenDir(&set_file, name, iCurrentDirectory))
+        {
+            BuildTrackIndex(&diskset[n], &set_file);
+            strncpy(diskset[n].name, set_file.name, 8); // copy base name
+            memset(&diskset[n].name[8], ' ', sizeof(diskset[n].name) - 8); // fill the rest of the name with spaces
+            diskset[n].status = DSK_INSERTED;
+            if (!(set_file.attributes & ATTR_READONLY) && diskset[n].format == ADF_STANDARD && diskset[n].sectors == DD_SECTORS) // compressed, extended and HD images are read only
+                diskset[n].status |= DSK_WRITABLE;
+            count++;
+        }
+        else
+            diskset[n].status = 0;
+    }
+
+    if (count)
+    {
+        diskset_drive = drive;
+        printf("Disk set: %u more disk(s) found\r", count);
+    }
+}
+
+unsigned char SwapDiskSet(unsigned char disk)
+{
+    // replaces the disk in the drive of the set with the given disk of the set, returns 0 if there is no such disk
+    adfTYPE *drive = diskset_drive;
+    unsigned char track;
+    unsigned char n;
+
+    if (!drive || disk >= DISKSET_SIZE || !(diskset[disk].status & DSK_INSERTED))
+        return(0);
+
+    FlushTrackBuffer(); // written sectors of the previous disk are stored
+
+    // the drive is reported empty for a moment so the Amiga gets the disk change signal
+    drive->status = 0;
+    UpdateDriveStatus();
+
+    // start clusters of tracks found while the previous disk was in the drive are kept
+    for (n = 0; n < DISKSET_SIZE; n++)
+        if (diskset[n].status & DSK_INSERTED && diskset[n].format == ADF_STANDARD && diskset[n].start_cluster == drive->start_cluster)
+            memcpy(diskset[n].cache, drive->cache, sizeof(drive->cache));
+
+    track = drive->track; // head position doesn't change
+    memcpy(drive, &diskset[disk], sizeof(adfTYPE));
+    drive->track = track;
+    drive->track_prev = -1;
+    drive->track_offset = 0;
+    drive->step = 1;
+
+    InvalidateTrackCache(drive);
+    RestoreFloppySpeed(); // new disk, new loader
+    UpdateDriveStatus();
+
+    printf("Disk set: disk %u inserted\r", disk + 1);
+    return(1);
 }
 
 void UpdateDriveStatus(void)
 {
+    // HD disk flags are sent in the lower nibble of the command byte
+    unsigned char hd;
+    unsigned char i;
+
+    hd = 0;
+    for (i = 0; i < 4; i++)
+        if (df[i].status & DSK_INSERTED && df[i].sectors == HD_SECTORS)
+            hd |= 1 << i;
+
     EnableFpga();
-    SPI(0x10);
+    SPI(0x10 | hd);
     SPI(df[0].status | (df[1].status << 1) | (df[2].status << 2) | (df[3].status << 3));
     DisableFpga();
 }
@@ -644,7 +1317,10 @@ void HandleFDD(unsigned char c1, unsigned char c2)
     {
         DISKLED_ON;
         sel = (c1 >> 6) & 0x03;
+        if (c2 != df[sel].track) // head step direction is used to guess the next track
+            df[sel].step = c2 > df[sel].track ? 1 : -1;
         df[sel].track = c2;
+        pdfx = &df[sel];
         ReadTrack(&df[sel]);
         DISKLED_OFF;
     }
@@ -652,7 +1328,10 @@ void HandleFDD(unsigned char c1, unsigned char c2)
     {
         DISKLED_ON;
         sel = (c1 >> 6) & 0x03;
+        if (c2 != df[sel].track)
+            df[sel].step = c2 > df[sel].track ? 1 : -1;
         df[sel].track = c2;
+        pdfx = &df[sel];
         WriteTrack(&df[sel]);
         DISKLED_OFF;
     }
@@ -8,15 +8,27 @@
 
 #define MAX_TRACKS (83*2)
 
+// sectors per track
+#define DD_SECTORS 11 /*double density disk (880 KB)*/
+#define HD_SECTORS 22 /*high density disk (1760 KB, read only)*/
+
+// image formats
+#define ADF_STANDARD 0 /*plain ADF image*/
+#define ADF_LZ4      1 /*LZ4 compressed image (read only)*/
+#define ADF_EXTENDED 2 /*UAE-1ADF extended image with raw MFM tracks (read only)*/
+
 typedef struct
 {
     unsigned char status; /*status of floppy*/
     unsigned char tracks; /*number of tracks*/
-    unsigned long cache[MAX_TRACKS]; /*cluster cache*/
-    unsigned long cluster_offset; /*cluster offset to handle tricky loaders*/
-    unsigned char sector_offset; /*sector offset to handle tricky loaders*/
+    unsigned char sectors; /*sectors per track*/
+    unsigned long cache[MAX_TRACKS]; /*cluster cache, 0 if not known yet (byte offsets of tracks for compressed and extended images)*/
+    unsigned long start_cluster; /*first cluster of compressed or extended image*/
+    unsigned char format; /*image format*/
+    unsigned short track_offset; /*byte offset in encoded track to handle tricky loaders (both halves of HD track)*/
     unsigned char track; /*current track*/
     unsigned char track_prev; /*previous track*/
+    signed char   step; /*direction of the last head step (next track guess)*/
     char          name[22]; /*floppy name*/
 } adfTYPE;
 
@@ -25,9 +37,24 @@ void SectorHeaderToFpga(unsigned char n, unsigned char dsksynch, unsigned char d
 //unsigned short SectorToFpga(unsigned char sector, unsigned char track, unsigned char dsksynch, unsigned char dsksyncl);
 void ReadTrack(adfTYPE *drive);
 unsigned char FindSync(adfTYPE *drive);
-unsigned char GetHeader(unsigned char *pTrack, unsigned char *pSector);
-unsigned char GetData(void);
+unsigned char FillWriteBuffer(adfTYPE *drive, unsigned short size);
+void DropWriteBuffer(unsigned short size);
+unsigned char GetHeader(adfTYPE *drive, unsigned char *pTrack, unsigned char *pSector);
+unsigned char GetData(adfTYPE *drive);
 void WriteTrack(adfTYPE *drive);
+void FlushTrackBuffer(void);
+unsigned char *GetTransferBuffer(void);
+void PrefetchTrack(adfTYPE *drive);
+void HandleFDDBackground(void);
 void UpdateDriveStatus(void);
 void HandleFDD(unsigned char c1, unsigned char c2);
+void InvalidateTrackCache(adfTYPE *drive);
+void BuildTrackIndex(adfTYPE *drive, fileTYPE *file);
+unsigned long GetTrackCluster(adfTYPE *drive, unsigned char track);
+unsigned char ReadImage(adfTYPE *drive, unsigned long offset, unsigned char *p, unsigned long size);
+void LoadImageTrack(adfTYPE *drive, unsigned char track);
+void ScanDiskSet(adfTYPE *drive, fileTYPE *file);
+unsigned char SwapDiskSet(unsigned char disk);
+void CheckFloppyTiming(adfTYPE *drive, unsigned short dsksync, unsigned short dsklen);
+void RestoreFloppySpeed(void);
 
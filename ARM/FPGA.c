@@ -21,6 +21,12 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 // 2009-10-10   - any length (any multiple of 8 bytes) fpga core file support
 // 2009-12-10   - changed command header id
 // 2010-04-14   - changed command header id
+// 2010-09-18   - waiting for FPGA status without continuous SPI polling
+// 2010-10-03   - faster configuration: DIN and CCLK written at once without branches, bitstream read in multiple sector chunks
+// 2010-10-04   - ROM files are sent from the memory card directly to the FPGA in multiple sector reads
+// 2010-10-05   - LZ4 compressed ROM and FPGA core files are decompressed on the fly
+// 2010-10-07   - a sector is sent in pieces from the sector buffer when less than a sector of the dma length remains
+//              - failed ROM upload (corrupted compressed file or read error) is reported by BootUpload()
 
 #include "AT91SAM7S256.h"
 #include "stdio.h"
@@ -28,73 +34,77 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "hardware.h"
 #include "FAT.h"
 #include "FDD.h"
+#include "LZ4.h"
 
 #define CMD_HDRID 0xAA69
 
+#define DIN_SHIFT 13 // data bit 7 shifted to DIN (PA20)
+#define FPGA_CHUNK_SECTORS 4 // bitstream is read from the card in chunks of multiple sectors (one card command per chunk)
+#define DIRECT_SECTORS 4 // sectors sent directly from the card per FPGA read request (at least 2 KB of the FIFO is free then)
+
 extern fileTYPE file;
 
 // single byte serialization of FPGA configuration datastream
+// DIN and CCLK are written at once through the output data status register (only these two pins are enabled for writing),
+// DIN changes with the falling edge of CCLK and is latched by the FPGA at its rising edge
+#pragma section_code_init
 void ShiftFpga(unsigned char data)
 {
-    AT91_REG *ppioa_codr = AT91C_PIOA_CODR;
-    AT91_REG *ppioa_sodr = AT91C_PIOA_SODR;
+    AT91_REG *ppioa_odsr = AT91C_PIOA_ODSR;
+    unsigned long d = (unsigned long)data << DIN_SHIFT; // bit 7 at DIN position
 
     // bit 0
-    *ppioa_codr = DIN | CCLK;
-    if (data & 0x80)
-        *ppioa_sodr = DIN;
-    *ppioa_sodr = CCLK;
+    *ppioa_odsr = d & DIN;
+    *ppioa_odsr = (d & DIN) | CCLK;
 
     // bit 1
-    *ppioa_codr = DIN | CCLK;
-    if (data & 0x40)
-        *ppioa_sodr = DIN;
-    *ppioa_sodr = CCLK;
+    d <<= 1;
+    *ppioa_odsr = d & DIN;
+    *ppioa_odsr = (d & DIN) | CCLK;
 
     // bit 2
-    *ppioa_codr = DIN | CCLK;
-    if (data & 0x20)
-        *ppioa_sodr = DIN;
-    *ppioa_sodr = CCLK;
+    d <<= 1;
+    *ppioa_odsr = d & DIN;
+    *ppioa_odsr = (d & DIN) | CCLK;
 
     // bit 3
-    *ppioa_codr = DIN | CCLK;
-    if (data & 0x10)
-        *ppioa_sodr = DIN;
-    *ppioa_sodr = CCLK;
+    d <<= 1;
+    *ppioa_odsr = d & DIN;
+    *ppioa_odsr = (d & DIN) | CCLK;
 
     // bit 4
-    *ppioa_codr = DIN | CCLK;
-    if (data & 0x08)
-        *ppioa_sodr = DIN;
-    *ppioa_sodr = CCLK;
+    d <<= 1;
+    *ppioa_odsr = d & DIN;
+    *ppioa_odsr = (d & DIN) | CCLK;
 
     // bit 5
-    *ppioa_codr = DIN | CCLK;
-    if (data & 0x04)
-        *ppioa_sodr = DIN;
-    *ppioa_sodr = CCLK;
+    d <<= 1;
+    *ppioa_odsr = d & DIN;
+    *ppioa_odsr = (d & DIN) | CCLK;
 
     // bit 6
-    *ppioa_codr = DIN | CCLK;
-    if (data & 0x02)
-        *ppioa_sodr = DIN;
-    *ppioa_sodr = CCLK;
+    d <<= 1;
+    *ppioa_odsr = d & DIN;
+    *ppioa_odsr = (d & DIN) | CCLK;
 
     // bit 7
-    *ppioa_codr = DIN | CCLK;
-    if (data & 0x01)
-        *ppioa_sodr = DIN;
-    *ppioa_sodr = CCLK;
-
+    d <<= 1;
+    *ppioa_odsr = d & DIN;
+    *ppioa_odsr = (d & DIN) | CCLK;
 }
+#pragma section_no_code_init
 
 // FPGA configuration
 unsigned char ConfigureFpga(void)
 {
     unsigned long  t;
     unsigned long  n;
+    unsigned long  size;
+    unsigned long  lz4_size;
     unsigned char *ptr;
+    unsigned char *buffer; // FPGA_CHUNK_SECTORS * 512 bytes, the same size as LZ4_CHUNK_SIZE
+
+    buffer = GetTransferBuffer();
 
     // set outputs
     *AT91C_PIOA_SODR = CCLK | DIN | PROG_B;
@@ -137,49 +147,76 @@ unsigned char ConfigureFpga(void)
     }
 
     printf("FPGA bitstream file opened\r");
+
+    // compressed core file is decompressed in chunks instead of read
+    lz4_size = LZ4_FileSize(&file);
+    if (lz4_size)
+        printf("FPGA bitstream file is compressed\r");
+
     printf("[");
 
+    // CCLK and DIN are written through ODSR
+    *AT91C_PIOA_OWER = CCLK | DIN;
+
     // send all bytes to FPGA in loop
     t = 0;
-    n = file.size >> 3;
-    ptr = sector_buffer;
-    do
+    size = (lz4_size ? lz4_size : file.size) & ~7; // multiple of 8 bytes
+    while (t < size)
     {
-        // read sector if 512 (64*8) bytes done
-        if ((t & 0x3F) == 0)
-        {
-            if (t & (1<<10))
-                *AT91C_PIOA_CODR = DISKLED;
-            else
-                *AT91C_PIOA_SODR = DISKLED;
+        if (t & (1<<13))
+            *AT91C_PIOA_CODR = DISKLED;
+        else
+            *AT91C_PIOA_SODR = DISKLED;
 
-            if ((t & 0x1FF) == 0)
-                printf("*");
+        if ((t & 0xFFF) == 0)
+            printf("*");
 
-            if (!FileRead(&file, sector_buffer))
-                return(0);
+        // read or decompress next chunk
+        if (lz4_size)
+        {
+            n = lz4_size - t;
+            if (n > LZ4_CHUNK_SIZE)
+                n = LZ4_CHUNK_SIZE;
 
-            ptr = sector_buffer;
+            if (!LZ4_DecompressBlock(buffer, n))
+            {
+                printf("]\rFPGA bitstream file is corrupted!\r");
+                FatalError(4);
+            }
         }
+        else
+        {
+            n = (size - t + 511) >> 9;
+            if (n > FPGA_CHUNK_SECTORS)
+                n = FPGA_CHUNK_SECTORS;
 
-        // send data in packets of 8 bytes
-        ShiftFpga(*ptr++);
-        ShiftFpga(*ptr++);
-        ShiftFpga(*ptr++);
-        ShiftFpga(*ptr++);
-        ShiftFpga(*ptr++);
-        ShiftFpga(*ptr++);
-        ShiftFpga(*ptr++);
-        ShiftFpga(*ptr++);
+            if (!FileReadEx(&file, buffer, n))
+                return(0);
 
-        t++;
+            n <<= 9;
+        }
 
-        // read next sector if 512 (64*8) bytes done
-        if ((t & 0x3F) == 0)
-            FileNextSector(&file);
+        ptr = buffer;
+        if (n > size - t)
+            n = size - t;
+        t += n;
 
+        // send data in packets of 8 bytes
+        n >>= 3;
+        while (n--)
+        {
+            ShiftFpga(*ptr++);
+            ShiftFpga(*ptr++);
+            ShiftFpga(*ptr++);
+            ShiftFpga(*ptr++);
+            ShiftFpga(*ptr++);
+            ShiftFpga(*ptr++);
+            ShiftFpga(*ptr++);
+            ShiftFpga(*ptr++);
+        }
     }
-    while (t < n);
+
+    *AT91C_PIOA_OWDR = CCLK | DIN;
 
     // disable outputs
     *AT91C_PIOA_ODR = CCLK | DIN | PROG_B;
@@ -197,55 +234,160 @@ unsigned char ConfigureFpga(void)
     return 0;
 }
 
-void SendFile(fileTYPE *file)
+unsigned short WaitDmaRequest(void)
+{
+    // waits for the FPGA floppy read request and returns the remaining dma length (in words)
+    unsigned char  c1;
+    unsigned short dsklen;
+
+    do
+    {
+        // read FPGA status
+        EnableFpga();
+        c1 = SPI(0);
+        SPI(0);
+        SPI(0);
+        SPI(0);
+        dsklen  = SPI(0) << 8 & 0x3F00; // msb of mfm words to transfer
+        dsklen |= SPI(0); // lsb of mfm words to transfer
+        DisableFpga();
+    }
+    while (!(c1 & CMD_RDTRK));
+
+    return(dsklen);
+}
+
+void SendBuffer(unsigned char *p, unsigned long size)
+{
+    // sends data to the FPGA floppy FIFO in pieces limited by the FIFO space (2 KB free on read request)
+    // and the remaining dma length
+    unsigned long count;
+
+    while (size)
+    {
+        count = (unsigned long)WaitDmaRequest() << 1; // bytes
+        if (count == 0) // the FIFO takes whole words
+            count = 2;
+        if (count > size)
+            count = size;
+
+        // floppy data command, data follow after the header
+        EnableFpga();
+        SPI(0);
+        SPI(0);
+        SPI(0);
+        SPI(0);
+        SPI(0);
+        SPI(0);
+        *AT91C_SPI_TPR = (unsigned long)p;
+        *AT91C_SPI_TCR = count;
+        *AT91C_SPI_TNCR = 0;
+        *AT91C_SPI_PTCR = AT91C_PDC_TXTEN; // start DMA transfer
+        while (!(*AT91C_SPI_SR & AT91C_SPI_ENDTX)); // wait for tranfer end
+        *AT91C_SPI_PTCR = AT91C_PDC_TXTDIS; // disable transmitter
+        SPI_Wait4XferEnd();
+        DisableFpga();
+
+        p += count;
+        size -= count;
+    }
+}
+
+unsigned char SendCompressedFile(fileTYPE *file, unsigned long size)
 {
-    unsigned char  c1, c2;
-    unsigned long  j;
+    // compressed file is decompressed in chunks which are sent to the FPGA floppy FIFO by SendBuffer()
+    // returns 0 if the file is corrupted
+    unsigned char *buffer = GetTransferBuffer(); // LZ4_CHUNK_SIZE bytes
     unsigned long  n;
-    unsigned char *p;
+    unsigned long  t;
 
     printf("[");
-    n = (file->size + 511) >> 9; // sector count (rounded up)
-    while (n--)
+    for (t = 0; t < size; t += n)
     {
-        // read data sector from memory card
-        FileRead(file, sector_buffer);
+        n = size - t;
+        if (n > LZ4_CHUNK_SIZE)
+            n = LZ4_CHUNK_SIZE;
 
-        do
+        if (!LZ4_DecompressBlock(buffer, n))
         {
-            // read FPGA status
-            EnableFpga();
-            c1 = SPI(0);
-            c2 = SPI(0);
-            SPI(0);
-            SPI(0);
-            SPI(0);
-            SPI(0);
-            DisableFpga();
+            printf("]\rCompressed file is corrupted!\r");
+            return(0);
         }
-        while (!(c1 & CMD_RDTRK));
 
-        if ((n & 15) == 0)
+        if ((t & 0x1FFF) == 0)
+            printf("*");
+
+        SendBuffer(buffer, n);
+    }
+    printf("]\r");
+    return(1);
+}
+
+unsigned char SendFile(fileTYPE *file)
+{
+    // file data goes from the memory card directly to the FPGA floppy FIFO (FPGA2 asserted during data blocks)
+    // several sectors are read in one multiple block read as long as the FIFO space and the remaining dma length allow,
+    // a sector is never sent beyond the remaining dma length (it goes through the sector buffer in pieces then)
+    // LZ4 compressed files are decompressed on the fly
+    // returns 0 if the file can't be read or is corrupted
+    unsigned short dsklen;
+    unsigned long  count;
+    unsigned long  i;
+    unsigned long  n;
+
+    n = LZ4_FileSize(file);
+    if (n)
+        return(SendCompressedFile(file, n));
+
+    printf("[");
+    n = (file->size + 511) >> 9; // sector count (rounded up)
+    i = 0;
+    while (i < n)
+    {
+        dsklen = WaitDmaRequest();
+
+        count = dsklen >> 8; // whole sectors of the remaining dma length
+        if (count > DIRECT_SECTORS)
+            count = DIRECT_SECTORS;
+        if (count > n - i)
+            count = n - i;
+
+        if ((i & 15) < (count ? count : 1))
             printf("*");
 
-        // send data sector to FPGA
+        if (count == 0)
+        { // less than a sector of the dma length remains
+            if (!FileReadEx(file, sector_buffer, 1))
+            {
+                printf("]\rFile read error!\r");
+                return(0);
+            }
+
+            SendBuffer(sector_buffer, 512);
+            i++;
+            continue;
+        }
+
+        // floppy data command, sector data follow directly from the card
         EnableFpga();
-        c1 = SPI(0);
-        c2 = SPI(0);
         SPI(0);
         SPI(0);
         SPI(0);
         SPI(0);
-        p = sector_buffer;
-
-        for (j = 0; j < 512; j++)
-            SPI(*p++);
-
+        SPI(0);
+        SPI(0);
         DisableFpga();
 
-        FileNextSector(file);
+        if (!FileReadEx(file, NULL, count))
+        {
+            printf("]\rFile read error!\r");
+            return(0);
+        }
+
+        i += count;
     }
     printf("]\r");
+    return(1);
 }
 
 // print message on the boot screen
@@ -371,7 +513,11 @@ char BootUpload(fileTYPE *file, unsigned char base, unsigned char size)
                 DisableFpga();
                 printf("uploading ROM file...\r");
                 // send rom image to FPGA
-                SendFile(file);
+                if (!SendFile(file))
+                {
+                    printf("ROM file upload failed!\r");
+                    return -1;
+                }
                 printf("ROM file uploaded.\r");
                 return 0;
             }
@@ -475,3 +621,19 @@ unsigned char GetFPGAStatus(void)
 
     return status;
 }
+
+unsigned char WaitFPGAStatus(unsigned char mask)
+{
+    // waits for any of the requested status bits
+    // FPGA signals new requests on INIT_B so between them the processor stays idle
+    unsigned char status;
+
+    while (1)
+    {
+        LatchFpgaRequest(); // must be cleared before the status is read
+        status = GetFPGAStatus();
+        if (status & mask)
+            return status;
+        WaitFpgaRequest();
+    }
+}
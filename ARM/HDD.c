@@ -18,6 +18,19 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 // 2009-11-22 - read/write multiple implemented
+// 2010-09-12 - raw card partitions as IDE units, LBA addressing
+// 2010-09-13 - hardfile index is stored on the card and reused when the FAT has not changed
+// 2010-09-14 - extent table replaces coarse index unless the hardfile is too fragmented
+// 2010-09-15 - write-back buffer, FLUSH CACHE and SET FEATURES (write cache on/off) commands
+// 2010-09-16 - sparse hardfile containers, blocks are allocated on first write
+// 2010-10-06 - hardfile index is validated by the checksum of the hardfile's own cluster chain
+//            - packed extent table replaces coarse index when the hardfile is too fragmented
+//            - write-back buffer is flushed and enabled again after Amiga reset
+//            - card partitions of FAT or extended type or overlapping the FAT volume are refused
+// 2010-10-07 - hardfile index is validated by the FAT links at its extent boundaries
+// 2010-09-17 - copy-on-write delta overlay with commit and discard
+// 2010-09-18 - IDE command trace (ring buffer, serial dump and capture to card)
+// 2010-09-19 - floppy requests are served between sectors of IDE transfers, background work split from HandleHDD()
 
 #include "AT91SAM7S256.h"
 #include "stdio.h"
@@ -28,11 +41,38 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "HDD.h"
 #include "MMC.h"
 #include "FPGA.h"
+#include "firmware.h"
 #include "config.h"
+#include "tasks.h"
 
 // hardfile structure
 hdfTYPE hdf[2];
 
+// delta overlay (only one unit at a time because of memory constraints)
+hdfTYPE delta_hdf;
+unsigned char delta_unit = HDF_NO_DELTA;
+unsigned char delta_buffer[512]; // copy-on-write buffer, sector_buffer is used by FAT updates during block allocation
+
+// IDE command trace
+tracerecordTYPE trace[IDE_TRACE_SIZE];
+unsigned long trace_head;       // number of recorded commands
+unsigned long trace_tail;       // next record to be written to the capture file
+unsigned long trace_dropped;
+unsigned long trace_records;    // records in the capture file
+unsigned long trace_time;       // microsecond counter
+unsigned long trace_last;       // last PIT value (microseconds modulo 4096 ms)
+unsigned char trace_capture;
+fileTYPE trace_file;
+
+// write-back buffer
+unsigned char write_cache_enabled = 1;
+unsigned char write_cache_unit;
+unsigned long write_cache_lba;          // first buffered sector
+unsigned long write_cache_count;        // number of buffered sectors
+unsigned long write_cache_timer;
+unsigned char write_cache[WRITE_CACHE_SECTORS * 512];
+unsigned char reset_count;              // Amiga reset counter seen with the last IDE command
+
 // helper function for byte swapping
 void SwapBytes(char *ptr, unsigned long len)
 {
@@ -63,7 +103,12 @@ void IdentifyDevice(unsigned short *pBuffer, unsigned char unit)
     p = (char*)&pBuffer[27];
     memcpy(p, "YAQUBE                                  ", 40); // model name - byte swapped
     p += 8;
-    if (config.hardfile[unit].long_name[0])
+    if (hdf[unit].type != HDF_FILE)
+    {
+        memcpy(p, "CARD PARTITION ", 15); // card partition number as model name
+        p[15] = '0' + hdf[unit].type - HDF_CARDPART(0);
+    }
+    else if (config.hardfile[unit].long_name[0])
     {
         for (i = 0; (x = config.hardfile[unit].long_name[i]) && i < 16; i++) // copy file name as model name
             p[i] = x;
@@ -75,12 +120,24 @@ void IdentifyDevice(unsigned short *pBuffer, unsigned char unit)
     SwapBytes((char*)&pBuffer[27], 40);
 
     pBuffer[47] = 0x8010; //maximum sectors per block in Read/Write Multiple command
+    pBuffer[49] = 1 << 9; // LBA supported
     pBuffer[53] = 1;
     pBuffer[54] = hdf[unit].cylinders;
     pBuffer[55] = hdf[unit].heads;
     pBuffer[56] = hdf[unit].sectors;
     pBuffer[57] = (unsigned short)total_sectors;
     pBuffer[58] = (unsigned short)(total_sectors >> 16);
+    pBuffer[82] = 1 << 5; // write cache supported
+    pBuffer[83] = 1 << 14 | 1 << 12; // FLUSH CACHE supported
+    pBuffer[84] = 1 << 14;
+    pBuffer[85] = write_cache_enabled ? 1 << 5 : 0; // write cache enabled
+    pBuffer[86] = 1 << 12; // FLUSH CACHE supported
+    pBuffer[87] = 1 << 14;
+    total_sectors = hdf[unit].size;
+    if (total_sectors > 0x0FFFFFFF) // LBA28 limit
+        total_sectors = 0x0FFFFFFF;
+    pBuffer[60] = (unsigned short)total_sectors; // total number of sectors in LBA mode
+    pBuffer[61] = (unsigned short)(total_sectors >> 16);
 }
 
 unsigned long chs2lba(unsigned short cylinder, unsigned char head, unsigned short sector, unsigned char unit)
@@ -88,6 +145,14 @@ unsigned long chs2lba(unsigned short cylinder, unsigned char head, unsigned shor
     return(cylinder * hdf[unit].heads + head) * hdf[unit].sectors + sector - 1;
 }
 
+unsigned long tfr2lba(unsigned char *tfr, unsigned char unit)
+{ // decodes sector address from task file registers
+    if (tfr[6] & IDE_DRIVEHEAD_LBA) // LBA28 addressing
+        return tfr[3] | (tfr[4] << 8) | (tfr[5] << 16) | ((unsigned long)(tfr[6] & 0x0F) << 24);
+    else
+        return chs2lba(tfr[4] | (tfr[5] << 8), tfr[6] & 0x0F, tfr[3], unit);
+}
+
 void WriteTaskFile(unsigned char error, unsigned char sector_count, unsigned char sector_number, unsigned char cylinder_low, unsigned char cylinder_high, unsigned char drive_head)
 {
     EnableFpga();
@@ -131,17 +196,70 @@ void WriteStatus(unsigned char status)
     DisableFpga();
 }
 
+unsigned char *GetWriteBuffer(unsigned char unit, unsigned long lba)
+{
+    // returns buffer for the sector to be written
+    // the write-back buffer is flushed first if the sector doesn't continue the buffered run
+
+    if (!write_cache_enabled)
+        return(write_cache); // not sector_buffer which is used by FAT updates when sparse blocks are allocated
+
+    if (write_cache_count && (write_cache_unit != unit || write_cache_lba + write_cache_count != lba))
+        FlushWriteCache();
+
+    if (write_cache_count == 0)
+    {
+        write_cache_unit = unit;
+        write_cache_lba = lba;
+    }
+
+    return(&write_cache[write_cache_count << 9]);
+}
+
+void WriteBufferedSector(unsigned char unit, unsigned long lba, unsigned char *pBuffer)
+{
+    // called when the buffer returned by GetWriteBuffer() has been filled
+
+    if (!write_cache_enabled)
+    {
+        HardFileWrite(&hdf[unit], lba, pBuffer, 1);
+        return;
+    }
+
+    write_cache_count++;
+    write_cache_timer = GetTimer(WRITE_CACHE_TIMEOUT);
+
+    if (write_cache_count == WRITE_CACHE_SECTORS) // buffer full
+        FlushWriteCache();
+}
+
+void FlushWriteCache(void)
+{
+    if (write_cache_count)
+    {
+        HardFileWrite(&hdf[write_cache_unit], write_cache_lba, write_cache, write_cache_count);
+        write_cache_count = 0;
+    }
+}
+
+void FlushWriteCacheRange(unsigned char unit, unsigned long lba, unsigned long count)
+{
+    if (write_cache_count && write_cache_unit == unit && lba < write_cache_lba + write_cache_count && lba + count > write_cache_lba)
+        FlushWriteCache();
+}
+
 void HandleHDD(unsigned char c1, unsigned char c2)
 {
     unsigned short id[256];
     unsigned char  tfr[8];
     unsigned short i;
-    unsigned short sector;
-    unsigned short cylinder;
-    unsigned char  head;
+    unsigned long  lba;
     unsigned char  unit;
     unsigned short sector_count;
     unsigned short block_count;
+    unsigned char  *buffer;
+    unsigned long  start;
+    unsigned char  c;
 
     if (c1 & CMD_IDECMD)
     {
@@ -152,7 +270,7 @@ void HandleHDD(unsigned char c1, unsigned char c2)
         SPI(0x00);
         SPI(0x00);
         SPI(0x00);
-        SPI(0x00);
+        c = SPI(0x00) & 0x0F; // Amiga reset counter
         for (i = 0; i < 8; i++)
         {
             SPI(0);
@@ -160,7 +278,15 @@ void HandleHDD(unsigned char c1, unsigned char c2)
         }
         DisableFpga();
 
+        if (c != reset_count)
+        { // the Amiga has been reset since the last command, write cache setting returns to its default
+            reset_count = c;
+            FlushWriteCache();
+            write_cache_enabled = 1;
+        }
+
         unit = tfr[6] & 0x10 ? 1 : 0; // master/slave selection
+        start = TraceTime();
 
         if (0)
         {
@@ -219,52 +345,60 @@ void HandleHDD(unsigned char c1, unsigned char c2)
 
             WriteStatus(IDE_STATUS_END | IDE_STATUS_IRQ);
         }
+        else if (tfr[7] == ACMD_FLUSH_CACHE) // Flush Cache
+        {
+            FlushWriteCache();
+            WriteTaskFile(0, tfr[2], tfr[3], tfr[4], tfr[5], tfr[6]);
+            WriteStatus(IDE_STATUS_END | IDE_STATUS_IRQ);
+        }
+        else if (tfr[7] == ACMD_SET_FEATURES && (tfr[1] == SETFEATURES_WRITE_CACHE_ON || tfr[1] == SETFEATURES_WRITE_CACHE_OFF)) // Set Features
+        {
+            printf("Set Features: write cache %s\r", tfr[1] == SETFEATURES_WRITE_CACHE_ON ? "on" : "off");
+            FlushWriteCache();
+            write_cache_enabled = tfr[1] == SETFEATURES_WRITE_CACHE_ON;
+            WriteTaskFile(0, tfr[2], tfr[3], tfr[4], tfr[5], tfr[6]);
+            WriteStatus(IDE_STATUS_END | IDE_STATUS_IRQ);
+        }
         else if (tfr[7] == ACMD_READ_SECTORS) // Read Sectors
         {
             WriteStatus(IDE_STATUS_RDY); // pio in (class 1) command type
 
-            sector = tfr[3];
-            cylinder = tfr[4] | (tfr[5] << 8);
-            head = tfr[6] & 0x0F;
+            lba = tfr2lba(tfr, unit);
             sector_count = tfr[2];
             if (sector_count == 0)
                sector_count = 0x100;
 
-            if (hdf[unit].file.size)
-                HardFileSeek(&hdf[unit], chs2lba(cylinder, head, sector, unit));
+            FlushWriteCacheRange(unit, lba, sector_count); // requested sectors may still be in the write-back buffer
 
             while (sector_count)
             {
-                while (!(GetFPGAStatus() & CMD_IDECMD)); // wait for empty sector buffer
+                WaitFPGAStatus(CMD_IDECMD); // wait for empty sector buffer
 
                 WriteStatus(IDE_STATUS_IRQ);
 
-                if (hdf[unit].file.size)
-                {
-                    FileRead(&hdf[unit].file, NULL);
-                    FileSeek(&hdf[unit].file, 1, SEEK_CUR);
-                }
+                if (hdf[unit].size)
+                    HardFileRead(&hdf[unit], lba, NULL, 1); // NULL enables direct transfer to the FPGA
 
+                lba++;
                 sector_count--; // decrease sector count
+
+                Yield(TASK_FDD);
             }
         }
         else if (tfr[7] == ACMD_READ_MULTIPLE) // Read Multiple Sectors (multiple sector transfer per IRQ)
         {
             WriteStatus(IDE_STATUS_RDY); // pio in (class 1) command type
 
-            sector = tfr[3];
-            cylinder = tfr[4] | (tfr[5] << 8);
-            head = tfr[6] & 0x0F;
+            lba = tfr2lba(tfr, unit);
             sector_count = tfr[2];
             if (sector_count == 0)
                sector_count = 0x100;
 
-            if (hdf[unit].file.size)
-                HardFileSeek(&hdf[unit], chs2lba(cylinder, head, sector, unit));
+            FlushWriteCacheRange(unit, lba, sector_count); // requested sectors may still be in the write-back buffer
 
             while (sector_count)
             {
-                while (!(GetFPGAStatus() & CMD_IDECMD)); // wait for empty sector buffer
+                WaitFPGAStatus(CMD_IDECMD); // wait for empty sector buffer
 
                 block_count = sector_count;
                 if (block_count > hdf[unit].sectors_per_block)
@@ -272,30 +406,29 @@ void HandleHDD(unsigned char c1, unsigned char c2)
 
                 WriteStatus(IDE_STATUS_IRQ);
 
-                if (hdf[unit].file.size)
-                    FileReadEx(&hdf[unit].file, NULL, block_count); // NULL enables direct transfer to the FPGA
+                if (hdf[unit].size)
+                    HardFileRead(&hdf[unit], lba, NULL, block_count); // NULL enables direct transfer to the FPGA
 
+                lba += block_count;
                 sector_count -= block_count; // decrease sector count
+
+                Yield(TASK_FDD);
             }
         }
         else if (tfr[7] == ACMD_WRITE_SECTORS) // write sectors
         {
             WriteStatus(IDE_STATUS_REQ); // pio out (class 2) command type
 
-            sector = tfr[3];
-            cylinder = tfr[4] | (tfr[5] << 8);
-            head = tfr[6] & 0x0F;
+            lba = tfr2lba(tfr, unit);
             sector_count = tfr[2];
             if (sector_count == 0)
                 sector_count = 0x100;
 
-            if (hdf[unit].file.size)
-                HardFileSeek(&hdf[unit], chs2lba(cylinder, head, sector, unit));
-
             while (sector_count)
             {
-                while (!(GetFPGAStatus() & CMD_IDEDAT)); // wait for full write buffer
+                WaitFPGAStatus(CMD_IDEDAT); // wait for full write buffer
 
+                buffer = GetWriteBuffer(unit, lba);
                 EnableFpga();
                 SPI(CMD_IDE_DATA_RD); // read data command
                 SPI(0x00);
@@ -304,7 +437,7 @@ void HandleHDD(unsigned char c1, unsigned char c2)
                 SPI(0x00);
                 SPI(0x00);
                 for (i = 0; i < 512; i++)
-                    sector_buffer[i] = SPI(0xFF);
+                    buffer[i] = SPI(0xFF);
                 DisableFpga();
 
                 sector_count--; // decrease sector count
@@ -314,27 +447,23 @@ void HandleHDD(unsigned char c1, unsigned char c2)
                 else
                     WriteStatus(IDE_STATUS_END | IDE_STATUS_IRQ);
 
-                if (hdf[unit].file.size)
-                {
-                    FileWrite(&hdf[unit].file, sector_buffer);
-                    FileSeek(&hdf[unit].file, 1, SEEK_CUR);
-                }
+                if (hdf[unit].size)
+                    WriteBufferedSector(unit, lba, buffer);
+
+                lba++;
+
+                Yield(TASK_FDD);
             }
         }
         else if (tfr[7] == ACMD_WRITE_MULTIPLE) // write sectors
         {
             WriteStatus(IDE_STATUS_REQ); // pio out (class 2) command type
 
-            sector = tfr[3];
-            cylinder = tfr[4] | (tfr[5] << 8);
-            head = tfr[6] & 0x0F;
+            lba = tfr2lba(tfr, unit);
             sector_count = tfr[2];
             if (sector_count == 0)
                 sector_count = 0x100;
 
-            if (hdf[unit].file.size)
-                HardFileSeek(&hdf[unit], chs2lba(cylinder, head, sector, unit));
-
             while (sector_count)
             {
                 block_count = sector_count;
@@ -343,8 +472,9 @@ void HandleHDD(unsigned char c1, unsigned char c2)
 
                 while (block_count)
                 {
-                    while (!(GetFPGAStatus() & CMD_IDEDAT)); // wait for full write buffer
+                    WaitFPGAStatus(CMD_IDEDAT); // wait for full write buffer
 
+                    buffer = GetWriteBuffer(unit, lba);
                     EnableFpga();
                     SPI(CMD_IDE_DATA_RD); // read data command
                     SPI(0x00);
@@ -353,15 +483,13 @@ void HandleHDD(unsigned char c1, unsigned char c2)
                     SPI(0x00);
                     SPI(0x00);
                     for (i = 0; i < 512; i++)
-                        sector_buffer[i] = SPI(0xFF);
+                        buffer[i] = SPI(0xFF);
                     DisableFpga();
 
-                    if (hdf[unit].file.size)
-                    {
-                        FileWrite(&hdf[unit].file, sector_buffer);
-                        FileSeek(&hdf[unit].file, 1, SEEK_CUR);
-                    }
+                    if (hdf[unit].size)
+                        WriteBufferedSector(unit, lba, buffer);
 
+                    lba++;
                     block_count--;  // decrease block count
                     sector_count--; // decrease sector count
                 }
@@ -370,6 +498,8 @@ void HandleHDD(unsigned char c1, unsigned char c2)
                     WriteStatus(IDE_STATUS_IRQ);
                 else
                     WriteStatus(IDE_STATUS_END | IDE_STATUS_IRQ);
+
+                Yield(TASK_FDD);
             }
         }
         else
@@ -383,8 +513,34 @@ void HandleHDD(unsigned char c1, unsigned char c2)
             WriteTaskFile(0x04, tfr[2], tfr[3], tfr[4], tfr[5], tfr[6]);
             WriteStatus(IDE_STATUS_END | IDE_STATUS_IRQ | IDE_STATUS_ERR);
         }
+        TraceCommand(tfr[7], unit, tfr2lba(tfr, unit), tfr[2], tfr[1], start);
+        DISKLED_OFF;
+    }
+}
+
+void HandleHDDBackground(void)
+{
+    // work done between IDE commands
+    unsigned char  unit;
+    unsigned long  lba;
+    unsigned short sector_count;
+    unsigned long  start;
+
+    if (write_cache_count && CheckTimer(write_cache_timer)) // no more writes for a while
+    {
+        DISKLED_ON;
+        start = TraceTime();
+        unit = write_cache_unit;
+        lba = write_cache_lba;
+        sector_count = write_cache_count;
+        FlushWriteCache();
+        TraceCommand(IDE_TRACE_FLUSH, unit, lba, sector_count, 0, start);
         DISKLED_OFF;
     }
+    else if (trace_capture && trace_head - trace_tail >= 512 / sizeof(tracerecordTYPE)) // only between commands
+    {
+        WriteTraceSector();
+    }
 }
 
 void GetHardfileGeometry(hdfTYPE *pHDF)
@@ -394,10 +550,10 @@ void GetHardfileGeometry(hdfTYPE *pHDF)
     unsigned long i, head, cyl, spt;
     unsigned long sptt[] = { 63, 127, 255, -1 };
 
-    if (pHDF->file.size == 0)
+    if (pHDF->size == 0)
         return;
 
-    total = pHDF->file.size / 512;
+    total = pHDF->size;
 
     for (i = 0; sptt[i] >= 0; i++)
     {
@@ -405,7 +561,7 @@ void GetHardfileGeometry(hdfTYPE *pHDF)
         for (head = 4; head <= 16; head++)
         {
             cyl = total / (head * spt);
-            if (pHDF->file.size <= 512 * 1024 * 1024)
+            if (total <= 1024 * 1024) // 512 MB
             {
                 if (cyl <= 1023)
                     break;
@@ -428,74 +584,1324 @@ void GetHardfileGeometry(hdfTYPE *pHDF)
     pHDF->sectors = (unsigned short)spt;
 }
 
+unsigned char PackExtent(hdfTYPE *pHDF, unsigned long sector, unsigned long cluster, unsigned long limit)
+{
+    // appends an extent to the packed extent table, bytes from limit on must not be written
+    // every HDF_PACKED_BLOCK bytes block starts with the sector and cluster of its first extent,
+    // each following extent is stored as the length of the previous one in clusters and the distance
+    // of its first cluster from the end of the previous one (zigzag encoded), both 7 bits per byte,
+    // a zero length byte ends the block
+    // returns 0 if there is no room left
+
+    unsigned char buffer[10];
+    unsigned long n;
+    unsigned long run;
+    unsigned long delta;
+    unsigned long offset;
+
+    if (pHDF->extents)
+    {
+        run = (sector - pHDF->last_extent.sector) >> cluster_shift;
+        delta = cluster - (pHDF->last_extent.cluster + run);
+        delta = (long)delta < 0 ? ~(delta << 1) : delta << 1;
+
+        n = 0;
+        do
+        {
+            buffer[n++] = run > 0x7F ? (run & 0x7F) | 0x80 : run;
+            run >>= 7;
+        }
+        while (run);
+        do
+        {
+            buffer[n++] = delta > 0x7F ? (delta & 0x7F) | 0x80 : delta;
+            delta >>= 7;
+        }
+        while (delta);
+
+        offset = pHDF->packed_size & (HDF_PACKED_BLOCK - 1);
+        if (offset && offset + n <= HDF_PACKED_BLOCK)
+        { // the extent fits into the current block
+            if (pHDF->packed_size + n > limit)
+                return(0);
+
+            memcpy(&pHDF->packed[pHDF->packed_size], buffer, n);
+            pHDF->packed_size += n;
+            goto done;
+        }
+
+        pHDF->packed_size = (pHDF->packed_size + HDF_PACKED_BLOCK - 1) & ~(HDF_PACKED_BLOCK - 1);
+    }
+
+    // new block
+    if (pHDF->packed_size + 8 > limit)
+        return(0);
+
+    *(unsigned long*)&pHDF->packed[pHDF->packed_size] = sector;
+    *(unsigned long*)&pHDF->packed[pHDF->packed_size + 4] = cluster;
+    pHDF->packed_size += 8;
+
+done:
+    if ((pHDF->packed_size & (HDF_PACKED_BLOCK - 1)) && pHDF->packed_size < limit)
+        pHDF->packed[pHDF->packed_size] = 0; // end of block
+
+    pHDF->last_extent.sector = sector;
+    pHDF->last_extent.cluster = cluster;
+    pHDF->extents++;
+    return(1);
+}
+
+void PackExtentTable(hdfTYPE *pHDF)
+{
+    // converts the full extent table to the packed encoding in place,
+    // the packed data never gets ahead of the extents not converted yet
+
+    extentTYPE extent;
+    unsigned long n = pHDF->extents;
+    unsigned long i;
+
+    pHDF->packed_size = 0;
+    pHDF->extents = 0;
+
+    for (i = 0; i < n; i++)
+    {
+        extent = pHDF->extent[i];
+        if (!PackExtent(pHDF, extent.sector, extent.cluster, (i + 1) * sizeof(extentTYPE)))
+        {
+            pHDF->tail = extent; // the rest of the hardfile is reached through the cluster chain
+            return;
+        }
+    }
+}
+
+unsigned char AddExtent(hdfTYPE *pHDF, unsigned long sector, unsigned long cluster)
+{
+    // appends an extent, the extent table is packed when it's full
+    // returns 0 when the index is full, the extent becomes the start of the cluster chain walk for the rest of the hardfile
+
+    if (pHDF->tail.cluster)
+        return(0);
+
+    if (!pHDF->packed_size)
+    {
+        if (pHDF->extents < HDF_MAX_EXTENTS)
+        {
+            pHDF->extent[pHDF->extents].sector = sector;
+            pHDF->extent[pHDF->extents].cluster = cluster;
+            pHDF->extents++;
+            return(1);
+        }
+
+        printf("Hardfile too fragmented, packing extent table\r");
+        PackExtentTable(pHDF);
+        if (pHDF->tail.cluster)
+            return(0);
+    }
+
+    if (PackExtent(pHDF, sector, cluster, sizeof(pHDF->packed)))
+        return(1);
+
+    pHDF->tail.sector = sector;
+    pHDF->tail.cluster = cluster;
+    return(0);
+}
+
 void BuildHardfileIndex(hdfTYPE *pHDF)
 {
-    // builds index to speed up hard file seek
+    // builds table of contiguous cluster runs, seek within any run needs no FAT access
+    // the cluster chain is walked once, a hardfile with more fragments than the index can hold
+    // is walked from the last indexed extent when seeking beyond it
 
     fileTYPE *file = &pHDF->file;
-    unsigned long *index = pHDF->index;
+    unsigned long sector;
+    unsigned long sectors;
+    unsigned long previous;
+
+    pHDF->extents = 0;
+    pHDF->packed_size = 0;
+    pHDF->tail.sector = 0;
+    pHDF->tail.cluster = 0;
+    previous = 0;
+    sectors = (file->size + 511) >> 9;
+    for (sector = 0; sector < sectors; sector += cluster_size)
+    {
+        Yield(TASK_FDD); // IDE requests would access the hardfile being opened
+
+        if (!FileSeek(file, sector, SEEK_SET))
+            break;
+
+        if (file->cluster != previous + 1) // start of new extent
+            if (!AddExtent(pHDF, sector, file->cluster))
+                break;
+
+        previous = file->cluster;
+    }
+}
+
+unsigned char CheckExtentLink(hdfTYPE *pHDF, extentTYPE *previous, unsigned long sector, unsigned long cluster)
+{
+    // checks that the last cluster of the previous extent links to the first cluster of the next one
+    // (cluster 0 means the previous extent has to end the chain), the first extent has to start the chain
+
+    unsigned long link;
+
+    if (previous->cluster)
+    {
+        Yield(TASK_FDD); // IDE requests would access the hardfile being opened
+
+        link = GetFATLink(previous->cluster + ((sector - previous->sector) >> cluster_shift) - 1);
+        if (cluster ? link != cluster : link < (fat32 ? 0x0FFFFFF8 : 0xFFF8))
+            return(0);
+    }
+    else if (sector != 0 || cluster != pHDF->file.start_cluster)
+        return(0);
+
+    previous->sector = sector;
+    previous->cluster = cluster;
+    return(1);
+}
+
+unsigned char CheckHardfileIndex(hdfTYPE *pHDF)
+{
+    // the index is valid as long as every extent still links to the next one and the last one ends the chain
+    // (or links to the tail), one FAT link is read per extent instead of walking the whole chain
+
+    extentTYPE previous;
+    unsigned char *p;
+    unsigned char *end;
+    unsigned long sector;
+    unsigned long cluster;
+    unsigned long run;
+    unsigned long delta;
+    unsigned long i;
+    unsigned char shift;
+
+    previous.sector = 0;
+    previous.cluster = 0;
+
+    if (!pHDF->packed_size)
+    {
+        if (pHDF->extents > HDF_MAX_EXTENTS)
+            return(0);
+
+        for (i = 0; i < pHDF->extents; i++)
+            if (!CheckExtentLink(pHDF, &previous, pHDF->extent[i].sector, pHDF->extent[i].cluster))
+                return(0);
+    }
+    else
+    {
+        if (pHDF->packed_size > sizeof(pHDF->packed))
+            return(0);
+
+        i = 0;
+        for (p = pHDF->packed; p < &pHDF->packed[pHDF->packed_size]; p = end)
+        {
+            end = p + HDF_PACKED_BLOCK;
+            if (end > &pHDF->packed[pHDF->packed_size])
+                end = &pHDF->packed[pHDF->packed_size];
+
+            sector = *(unsigned long*)p;
+            cluster = *(unsigned long*)(p + 4);
+            p += 8;
+
+            while (1)
+            {
+                if (!CheckExtentLink(pHDF, &previous, sector, cluster))
+                    return(0);
+                i++;
+
+                if (p >= end || !*p)
+                    break;
+
+                run = 0;
+                shift = 0;
+                do
+                {
+                    run |= (*p & 0x7F) << shift;
+                    shift += 7;
+                }
+                while (*p++ & 0x80);
+
+                delta = 0;
+                shift = 0;
+                do
+                {
+                    delta |= (*p & 0x7F) << shift;
+                    shift += 7;
+                }
+                while (*p++ & 0x80);
+
+                sector += run << cluster_shift;
+                cluster += run + (delta & 1 ? ~(delta >> 1) : delta >> 1);
+            }
+        }
+
+        if (i != pHDF->extents)
+            return(0);
+    }
+
+    if (pHDF->tail.cluster)
+        return(CheckExtentLink(pHDF, &previous, pHDF->tail.sector, pHDF->tail.cluster));
+
+    return(CheckExtentLink(pHDF, &previous, (((pHDF->file.size + 511) >> 9) + cluster_size - 1) & cluster_mask, 0));
+}
+
+unsigned char LoadHardfileIndex(hdfTYPE *pHDF, char *name)
+{
+    // loads previously stored hardfile index, it's only valid if the cluster chain of the hardfile hasn't changed
+
+    fileTYPE idx;
+    hdfindexTYPE *pHeader = (hdfindexTYPE*)sector_buffer;
+    unsigned char *p;
+    unsigned long i;
+
+    if (!FileOpen(&idx, name))
+        return(0);
+
+    if (idx.size < HDF_INDEX_FILE_SIZE)
+        return(0);
+
+    if (!FileRead(&idx, sector_buffer))
+        return(0);
+
+    if (strncmp(pHeader->id, HDF_INDEX_ID, sizeof(pHeader->id)) != 0 || pHeader->start_cluster != pHDF->file.start_cluster || pHeader->size != pHDF->file.size)
+    {
+        printf("Hardfile index doesn't match the hardfile\r");
+        return(0);
+    }
+
+    pHDF->extents = pHeader->extents;
+    pHDF->packed_size = pHeader->packed_size;
+    pHDF->last_extent = pHeader->last_extent;
+    pHDF->tail = pHeader->tail;
+
+    p = pHDF->packed;
+    for (i = 0; i < sizeof(pHDF->packed) >> 9; i++)
+    {
+        FileNextSector(&idx);
+        if (!FileRead(&idx, p))
+            return(0);
+        p += 512;
+    }
+
+    if (!CheckHardfileIndex(pHDF))
+    {
+        printf("Hardfile index is out of date\r");
+        return(0);
+    }
+
+    return(1);
+}
+
+unsigned char SaveHardfileIndex(hdfTYPE *pHDF, char *name)
+{
+    fileTYPE idx;
+    hdfindexTYPE *pHeader = (hdfindexTYPE*)sector_buffer;
+    unsigned char *p;
     unsigned long i;
-    unsigned long j;
 
-    pHDF->index_size = 16; // indexing size
-    j = 1 << pHDF->index_size;
-    i = pHDF->file.size >> 10; // divided by index table size (1024)
-    while (j < i) // find greater or equal power of two
+    if (FileOpen(&idx, name))
+    {
+        if (idx.size < HDF_INDEX_FILE_SIZE)
+        {
+            printf("Hardfile index file is too small!\r");
+            return(0);
+        }
+    }
+    else
+    {
+        strncpy(idx.name, name, 11);
+        idx.attributes = 0;
+        idx.size = HDF_INDEX_FILE_SIZE;
+        if (!FileCreate(DIRECTORY_ROOT, &idx))
+            return(0);
+    }
+
+    memset(sector_buffer, 0, sizeof(sector_buffer));
+    memcpy(pHeader->id, HDF_INDEX_ID, sizeof(pHeader->id));
+    pHeader->start_cluster = pHDF->file.start_cluster;
+    pHeader->size = pHDF->file.size;
+    pHeader->extents = pHDF->extents;
+    pHeader->packed_size = pHDF->packed_size;
+    pHeader->last_extent = pHDF->last_extent;
+    pHeader->tail = pHDF->tail;
+
+    if (!FileWrite(&idx, sector_buffer))
+        return(0);
+
+    p = pHDF->packed;
+    for (i = 0; i < sizeof(pHDF->packed) >> 9; i++)
+    {
+        FileNextSector(&idx);
+        if (!FileWrite(&idx, p))
+            return(0);
+        p += 512;
+    }
+
+    return(1);
+}
+
+unsigned long FindExtent(hdfTYPE *pHDF, unsigned long lba)
+{
+    // binary search for the last extent starting at or before the given sector
+    // returns the cluster of the sector
+
+    unsigned long lo = 0;
+    unsigned long hi = pHDF->extents - 1;
+    unsigned long mid;
+
+    while (lo < hi)
+    {
+        mid = (lo + hi + 1) >> 1;
+        if (pHDF->extent[mid].sector <= lba)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+
+    return(pHDF->extent[lo].cluster + ((lba - pHDF->extent[lo].sector) >> cluster_shift));
+}
+
+unsigned long FindPackedExtent(hdfTYPE *pHDF, unsigned long lba)
+{
+    // binary search for the last packed block starting at or before the given sector, then the block is decoded
+    // returns the cluster of the sector
+
+    unsigned char *p;
+    unsigned char *end;
+    unsigned long lo = 0;
+    unsigned long hi = (pHDF->packed_size - 1) / HDF_PACKED_BLOCK;
+    unsigned long mid;
+    unsigned long cluster;
+    unsigned long offset;
+    unsigned long run;
+    unsigned long delta;
+    unsigned char shift;
+
+    while (lo < hi)
     {
-        j <<= 1;
-        pHDF->index_size++;
+        mid = (lo + hi + 1) >> 1;
+        if (*(unsigned long*)&pHDF->packed[mid * HDF_PACKED_BLOCK] <= lba)
+            lo = mid;
+        else
+            hi = mid - 1;
     }
 
-    for (i = 0; i < file->size; i += j)
+    p = &pHDF->packed[lo * HDF_PACKED_BLOCK];
+    end = p + HDF_PACKED_BLOCK;
+    if (end > &pHDF->packed[pHDF->packed_size])
+        end = &pHDF->packed[pHDF->packed_size];
+
+    offset = (lba - *(unsigned long*)p) >> cluster_shift; // clusters from the start of the extent
+    cluster = *(unsigned long*)(p + 4);
+    p += 8;
+
+    while (p < end && *p)
     {
-        FileSeek(file, i >> 9, SEEK_SET); // FileSeek seeks in 512-byte sectors
-        *index++ = file->cluster;
+        run = 0;
+        shift = 0;
+        do
+        {
+            run |= (*p & 0x7F) << shift;
+            shift += 7;
+        }
+        while (*p++ & 0x80);
+
+        if (offset < run) // the sector lies in this extent
+            break;
+
+        delta = 0;
+        shift = 0;
+        do
+        {
+            delta |= (*p & 0x7F) << shift;
+            shift += 7;
+        }
+        while (*p++ & 0x80);
+
+        offset -= run;
+        cluster += run + (delta & 1 ? ~(delta >> 1) : delta >> 1);
     }
+
+    return(cluster + offset);
 }
 
 unsigned char HardFileSeek(hdfTYPE *pHDF, unsigned long lba)
 {
+    unsigned long reads = fat_reads;
+    unsigned char rc;
+
     if ((pHDF->file.sector ^ lba) & cluster_mask)
     { // different clusters
-        if ((pHDF->file.sector > lba) || ((pHDF->file.sector ^ lba) & (cluster_mask << (fat32 ? 7 : 8)))) // 7: 128 FAT32 links per sector, 8: 256 FAT16 links per sector
-        { // requested cluster lies before current pointer position or in different FAT sector
-            pHDF->file.cluster = pHDF->index[lba >> (pHDF->index_size - 9)];// minus 9 because lba is in 512-byte sectors
-            pHDF->file.sector = lba & (-1 << (pHDF->index_size - 9));
+        if (pHDF->tail.cluster && lba >= pHDF->tail.sector)
+        { // beyond the indexed extents the cluster chain is walked from the last one
+            if (pHDF->file.sector < pHDF->tail.sector || pHDF->file.sector > lba)
+            {
+                pHDF->file.cluster = pHDF->tail.cluster;
+                pHDF->file.sector = pHDF->tail.sector;
+            }
+        }
+        else if (pHDF->extents)
+        { // cluster is calculated directly from the extent table
+            pHDF->file.cluster = pHDF->packed_size ? FindPackedExtent(pHDF, lba) : FindExtent(pHDF, lba);
+            pHDF->file.sector = lba & cluster_mask;
         }
     }
-    return FileSeek(&pHDF->file, lba, SEEK_SET);
+    rc = FileSeek(&pHDF->file, lba, SEEK_SET);
+
+    pHDF->seeks++;
+    pHDF->seek_fat_reads += fat_reads - reads;
+
+    return(rc);
 }
 
-unsigned char OpenHardfile(unsigned char unit)
+unsigned char OpenSparseHardfile(hdfTYPE *pHDF)
 {
-    unsigned long time;
-    char filename[12];
+    // checks the first sector of the hardfile for sparse container header
 
-    strncpy(filename, config.hardfile[unit].name, 8);
-    strcpy(&filename[8], "HDF");
+    sparsehdfTYPE *header = (sparsehdfTYPE*)sector_buffer;
+    unsigned long blocks;
+    unsigned char shift;
+
+    pHDF->sparse = 0;
 
-    if (filename[0])
+    if (!FileRead(&pHDF->file, sector_buffer))
+        return 0;
+
+    if (strncmp(header->id, HDF_SPARSE_ID, sizeof(header->id)))
+        return 0; // plain hardfile
+
+    for (shift = 0; shift < 16 && (1UL << shift) < header->block_size; shift++);
+    blocks = (header->size + header->block_size - 1) >> shift;
+
+    if ((1UL << shift) != header->block_size || header->map_size < (blocks + HDF_SPARSE_MAP_ENTRIES - 1) / HDF_SPARSE_MAP_ENTRIES || (pHDF->file.size >> 9) < 1 + header->map_size
+     || header->blocks > ((pHDF->file.size >> 9) - 1 - header->map_size) >> shift)
     {
-        if (FileOpen(&hdf[unit].file, filename))
-        {
-            GetHardfileGeometry(&hdf[unit]);
+        printf("Invalid sparse hardfile header!\r");
+        return 0;
+    }
 
-            printf("HARDFILE %d:\r", unit);
-            printf("file: \"%.8s.%.3s\"\r", hdf[unit].file.name, &hdf[unit].file.name[8]);
-            printf("size: %lu (%lu MB)\r", hdf[unit].file.size, hdf[unit].file.size >> 20);
-            printf("CHS: %u.%u.%u", hdf[unit].cylinders, hdf[unit].heads, hdf[unit].sectors);
-            printf(" (%lu MB)\r", ((((unsigned long) hdf[unit].cylinders) * hdf[unit].heads * hdf[unit].sectors) >> 11));
+    pHDF->sparse = 1;
+    pHDF->block_shift = shift;
+    pHDF->size = header->size;
+    pHDF->data_start = 1 + header->map_size;
+    pHDF->blocks = header->blocks;
+    pHDF->last_cluster = 0;
+    pHDF->map_sector = -1;
 
-            time = GetTimer(0);
-            BuildHardfileIndex(&hdf[unit]);
-            time = GetTimer(0) - time;
-            printf("Hardfile indexed in %lu ms\r", time >> 20);
+    return 1;
+}
 
-            config.hardfile[unit].present = 1;
-            return 1;
-        }
+unsigned char SparseWriteHeader(hdfTYPE *pHDF)
+{
+    sparsehdfTYPE *header = (sparsehdfTYPE*)sector_buffer;
+
+    memset(sector_buffer, 0, sizeof(sector_buffer));
+    memcpy(header->id, HDF_SPARSE_ID, sizeof(header->id));
+    header->size = pHDF->size;
+    header->block_size = 1 << pHDF->block_shift;
+    header->map_size = pHDF->data_start - 1;
+    header->blocks = pHDF->blocks;
+
+    if (!HardFileSeek(pHDF, 0))
+        return 0;
+
+    return FileWrite(&pHDF->file, sector_buffer);
+}
+
+unsigned char SparseClear(hdfTYPE *pHDF)
+{
+    // unmaps all blocks, the space of the data blocks is reused by following allocations
+    // the map is cleared before the header so that map entries never point beyond the used blocks
+
+    if (!HardFileSeek(pHDF, 1))
+        return 0;
+
+    if (!FileWriteEx(&pHDF->file, NULL, pHDF->data_start - 1))
+        return 0;
+
+    pHDF->map_sector = -1;
+    pHDF->blocks = 0;
+
+    return SparseWriteHeader(pHDF);
+}
+
+unsigned char SparseLoadMap(hdfTYPE *pHDF, unsigned long map_sector)
+{
+    if (map_sector != pHDF->map_sector)
+    {
+        pHDF->map_sector = -1;
+
+        if (!HardFileSeek(pHDF, 1 + map_sector))
+            return 0;
+
+        if (!FileRead(&pHDF->file, (unsigned char*)pHDF->map))
+            return 0;
+
+        pHDF->map_sector = map_sector;
     }
 
-    config.hardfile[unit].present = 0;
+    return 1;
+}
+
+unsigned char SparseMap(hdfTYPE *pHDF, unsigned long lba, unsigned long *sector)
+{
+    // translates sector of the emulated disk to container file sector, 0 means the block is not allocated
+
+    unsigned long block = lba >> pHDF->block_shift;
+    unsigned long n;
+
+    if (!SparseLoadMap(pHDF, block / HDF_SPARSE_MAP_ENTRIES))
+        return 0;
+
+    n = pHDF->map[block % HDF_SPARSE_MAP_ENTRIES];
+    if (n > pHDF->blocks)
+    {
+        printf("SparseMap(): invalid map entry %lu for block %lu!\r", n, block);
+        return 0;
+    }
+
+    *sector = n ? pHDF->data_start + ((n - 1) << pHDF->block_shift) + (lba & ((1 << pHDF->block_shift) - 1)) : 0;
+
+    return 1;
+}
+
+void SparseIndexCluster(hdfTYPE *pHDF, unsigned long sector, unsigned long cluster)
+{
+    // adds a cluster appended to the container to the extent table
+    // when the index is full the cluster is reached through the cluster chain from the last indexed extent
+
+    if (cluster != pHDF->last_cluster + 1) // start of new extent
+        AddExtent(pHDF, sector, cluster);
+}
+
+unsigned char SparseAllocate(hdfTYPE *pHDF, unsigned long lba, hdfTYPE *pBase, unsigned char fill)
+{
+    // maps the block of given sector to a new data block, the container grows when there is no unused space left
+    // the new block is filled with zeros or copied from the base image (pBase) unless fill is 0
+    // the header is written first and the map last so an interrupted allocation leaves only unreferenced space
+
+    unsigned long block = lba >> pHDF->block_shift;
+    unsigned long sector;   // first sector of the new data block
+    unsigned long sectors;  // size of the container with the new block
+    unsigned long clusters; // number of clusters allocated to the container
+    unsigned long cluster;
+    unsigned long i;
+
+    if (!SparseLoadMap(pHDF, block / HDF_SPARSE_MAP_ENTRIES))
+        return 0;
+
+    sector = pHDF->data_start + (pHDF->blocks << pHDF->block_shift);
+    sectors = sector + (1 << pHDF->block_shift);
+    clusters = ((pHDF->file.size >> 9) + cluster_size - 1) / cluster_size;
+
+    if (sectors > (pHDF->file.size >> 9))
+    {
+        if (!pHDF->last_cluster)
+        { // find the last cluster of the container
+            if (!HardFileSeek(pHDF, (clusters - 1) * cluster_size))
+                return 0;
+
+            pHDF->last_cluster = pHDF->file.cluster;
+        }
+
+        while (clusters * cluster_size < sectors)
+        {
+            cluster = AllocateCluster(pHDF->last_cluster);
+            if (!cluster)
+            {
+                printf("SparseAllocate(): no space left for block %lu!\r", block);
+                FlushFAT();
+                return 0;
+            }
+
+            SparseIndexCluster(pHDF, clusters * cluster_size, cluster);
+
+            pHDF->last_cluster = cluster;
+            clusters++;
+        }
+
+        if (!FlushFAT())
+            return 0;
+
+        pHDF->file.size = sectors << 9;
+        if (!UpdateEntry(&pHDF->file))
+            return 0;
+    }
+
+    pHDF->blocks++;
+    if (!SparseWriteHeader(pHDF))
+        return 0;
+
+    if (fill && pBase)
+    { // copy-on-write, sectors beyond the end of the base image are cleared
+        for (i = 0; i < (1 << pHDF->block_shift); i++)
+        {
+            lba = (block << pHDF->block_shift) + i;
+            if (lba < pBase->size)
+            {
+                if (!HardFileReadImage(pBase, lba, delta_buffer, 1))
+                    return 0;
+            }
+            else
+                memset(delta_buffer, 0, sizeof(delta_buffer));
+
+            if (!HardFileSeek(pHDF, sector + i))
+                return 0;
+
+            if (!FileWrite(&pHDF->file, delta_buffer))
+                return 0;
+        }
+    }
+    else if (fill)
+    { // clear the new block so its unwritten sectors still read as zeros
+        if (!HardFileSeek(pHDF, sector))
+            return 0;
+
+        if (!FileWriteEx(&pHDF->file, NULL, 1 << pHDF->block_shift))
+            return 0;
+    }
+
+    pHDF->map[block % HDF_SPARSE_MAP_ENTRIES] = pHDF->blocks;
+
+    if (!HardFileSeek(pHDF, 1 + pHDF->map_sector))
+        return 0;
+
+    return FileWrite(&pHDF->file, (unsigned char*)pHDF->map);
+}
+
+unsigned char SparseRead(hdfTYPE *pHDF, unsigned long lba, unsigned char *pBuffer, unsigned long count, hdfTYPE *pBase)
+{
+// if pBuffer is NULL then the data is transferred directly to the FPGA
+// unallocated blocks are read from the base image (pBase) or as zeros if there is none
+
+    unsigned long sector;
+    unsigned long next;
+    unsigned long n;
+    unsigned short i;
+
+    while (count)
+    {
+        n = (1 << pHDF->block_shift) - (lba & ((1 << pHDF->block_shift) - 1)); // sectors left in the block
+        if (n > count)
+            n = count;
+
+        if (!SparseMap(pHDF, lba, &sector))
+            return 0;
+
+        if (sector)
+        {
+            if (!HardFileSeek(pHDF, sector))
+                return 0;
+
+            if (!(n == 1 ? FileRead(&pHDF->file, pBuffer) : FileReadEx(&pHDF->file, pBuffer, n)))
+                return 0;
+        }
+        else if (pBase)
+        { // untouched blocks are read from the base image in as few transfers as possible
+            while (n < count)
+            {
+                if (!SparseMap(pHDF, lba + n, &next))
+                    return 0;
+
+                if (next)
+                    break;
+
+                n += 1 << pHDF->block_shift;
+            }
+
+            if (n > count)
+                n = count;
+
+            if (!HardFileReadImage(pBase, lba, pBuffer, n))
+                return 0;
+        }
+        else if (pBuffer)
+            memset(pBuffer, 0, n << 9);
+        else
+        { // unallocated block, no card access
+            while (n--)
+            {
+                EnableFpga();
+                SPI(CMD_IDE_DATA_WR); // write data command
+                SPI(0x00);
+                SPI(0x00);
+                SPI(0x00);
+                SPI(0x00);
+                SPI(0x00);
+                for (i = 0; i < 512; i++)
+                    SPI(0x00);
+                DisableFpga();
+
+                lba++;
+                count--;
+            }
+            continue;
+        }
+
+        lba += n;
+        count -= n;
+        if (pBuffer)
+            pBuffer += n << 9;
+    }
+
+    return 1;
+}
+
+unsigned char SparseWrite(hdfTYPE *pHDF, unsigned long lba, unsigned char *pBuffer, unsigned long count, hdfTYPE *pBase)
+{
+// blocks are allocated on first write, partially written blocks are filled from the base image (pBase) or with zeros
+
+    unsigned long sector;
+    unsigned long n;
+
+    while (count)
+    {
+        n = (1 << pHDF->block_shift) - (lba & ((1 << pHDF->block_shift) - 1)); // sectors left in the block
+        if (n > count)
+            n = count;
+
+        if (!SparseMap(pHDF, lba, &sector))
+            return 0;
+
+        if (!sector)
+        {
+            if (!SparseAllocate(pHDF, lba, pBase, n != (1 << pHDF->block_shift))) // block is not completely overwritten
+                return 0;
+
+            if (!SparseMap(pHDF, lba, &sector))
+                return 0;
+        }
+
+        if (!HardFileSeek(pHDF, sector))
+            return 0;
+
+        if (!(n == 1 ? FileWrite(&pHDF->file, pBuffer) : FileWriteEx(&pHDF->file, pBuffer, n)))
+            return 0;
+
+        lba += n;
+        count -= n;
+        pBuffer += n << 9;
+    }
+
+    return 1;
+}
+
+unsigned char HardFileRead(hdfTYPE *pHDF, unsigned long lba, unsigned char *pBuffer, unsigned long count)
+{
+// if pBuffer is NULL then the data is transferred directly to the FPGA
+
+    if (lba + count > pHDF->size) // beyond the end of the hardfile
+        return 0;
+
+    if (pHDF->overlay && delta_hdf.blocks) // empty delta doesn't need map lookups
+        return SparseRead(&delta_hdf, lba, pBuffer, count, pHDF);
+
+    return HardFileReadImage(pHDF, lba, pBuffer, count);
+}
+
+unsigned char HardFileReadImage(hdfTYPE *pHDF, unsigned long lba, unsigned char *pBuffer, unsigned long count)
+{
+// reads the hardfile itself, bypassing the delta overlay
+
+    if (pHDF->type == HDF_FILE)
+    {
+        if (pHDF->sparse)
+            return SparseRead(pHDF, lba, pBuffer, count, NULL);
+
+        if (!HardFileSeek(pHDF, lba))
+            return 0;
+
+        if (count == 1)
+            return FileRead(&pHDF->file, pBuffer);
+        else
+            return FileReadEx(&pHDF->file, pBuffer, count);
+    }
+
+    // raw card partition, no cluster chain translation
+    if (count == 1)
+        return MMC_Read(pHDF->offset + lba, pBuffer);
+    else
+        return MMC_ReadMultiple(pHDF->offset + lba, pBuffer, count);
+}
+
+unsigned char HardFileWrite(hdfTYPE *pHDF, unsigned long lba, unsigned char *pBuffer, unsigned long count)
+{
+    if (lba + count > pHDF->size) // never write outside of the partition
+        return 0;
+
+    if (pHDF->overlay) // base image is never written while the overlay is active
+        return SparseWrite(&delta_hdf, lba, pBuffer, count, pHDF);
+
+    return HardFileWriteImage(pHDF, lba, pBuffer, count);
+}
+
+unsigned char HardFileWriteImage(hdfTYPE *pHDF, unsigned long lba, unsigned char *pBuffer, unsigned long count)
+{
+    if (pHDF->type == HDF_FILE)
+    {
+        if (pHDF->sparse)
+            return SparseWrite(pHDF, lba, pBuffer, count, NULL);
+
+        if (!HardFileSeek(pHDF, lba))
+            return 0;
+
+        if (count == 1)
+            return FileWrite(&pHDF->file, pBuffer);
+        else
+            return FileWriteEx(&pHDF->file, pBuffer, count);
+    }
+
+    if (count == 1)
+        return MMC_Write(pHDF->offset + lba, pBuffer);
+    else
+        return MMC_WriteMultiple(pHDF->offset + lba, pBuffer, count);
+}
+
+unsigned char OpenCardPartition(hdfTYPE *pHDF, unsigned char partition)
+{
+    unsigned char *p;
+    unsigned long start;
+    unsigned long size;
+
+    if (!MMC_Read(0, sector_buffer)) // read MBR
+        return 0;
+
+    if (sector_buffer[510] != 0x55 || sector_buffer[511] != 0xAA) // check signature
+        return 0;
+
+    p = &sector_buffer[446 + (partition << 4)]; // partition table entry
+    if (p[4] == 0x00)
+    {
+        printf("Card partition %u not defined!\r", partition);
+        return 0;
+    }
+
+    switch (p[4])
+    {
+    case 0x01: // FAT12
+    case 0x04: // FAT16 <32MB
+    case 0x06: // FAT16
+    case 0x0B: // FAT32 CHS
+    case 0x0C: // FAT32 LBA
+    case 0x0E: // FAT16 LBA
+    case 0x05: // extended CHS
+    case 0x0F: // extended LBA
+    case 0x85: // Linux extended
+        printf("Card partition %u type 0x%02X not supported!\r", partition, p[4]);
+        return 0;
+    }
+
+    pHDF->offset = p[8] | (p[9] << 8) | (p[10] << 16) | ((unsigned long)p[11] << 24);
+    pHDF->size = p[12] | (p[13] << 8) | (p[14] << 16) | ((unsigned long)p[15] << 24);
+    printf("card partition %u: type 0x%02X, start %lu\r", partition, p[4], pHDF->offset);
+
+    if (pHDF->offset == 0 || pHDF->size == 0 || pHDF->offset + pHDF->size < pHDF->offset)
+        return 0;
+
+    // the FAT volume in entry 0 must never be exposed to the Amiga
+    p = &sector_buffer[446];
+    start = p[8] | (p[9] << 8) | (p[10] << 16) | ((unsigned long)p[11] << 24);
+    size = p[12] | (p[13] << 8) | (p[14] << 16) | ((unsigned long)p[15] << 24);
+    if (pHDF->offset < start + size && start < pHDF->offset + pHDF->size)
+    {
+        printf("Card partition %u overlaps FAT partition!\r", partition);
+        return 0;
+    }
+
+    return 1;
+}
+
+unsigned char OpenHardfile(unsigned char unit)
+{
+    unsigned long time;
+    unsigned char partition;
+    char filename[12];
+
+    FlushWriteCache(); // buffered sectors belong to the previous hardfile
+
+    hdf[unit].overlay = 0;
+    if (delta_unit == unit)
+        delta_unit = HDF_NO_DELTA;
+
+    if (config.hardfile[unit].enabled >= HDF_CARDPART(1) && config.hardfile[unit].enabled <= HDF_CARDPART_MAX)
+    {
+        partition = config.hardfile[unit].enabled - HDF_CARDPART(0);
+        hdf[unit].type = config.hardfile[unit].enabled;
+        hdf[unit].sparse = 0;
+
+        if (OpenCardPartition(&hdf[unit], partition))
+        {
+            GetHardfileGeometry(&hdf[unit]);
+
+            printf("HARDFILE %d:\r", unit);
+            printf("card partition: %u\r", partition);
+            printf("size: %lu (%lu MB)\r", hdf[unit].size, hdf[unit].size >> 11);
+            printf("CHS: %u.%u.%u", hdf[unit].cylinders, hdf[unit].heads, hdf[unit].sectors);
+            printf(" (%lu MB)\r", ((((unsigned long) hdf[unit].cylinders) * hdf[unit].heads * hdf[unit].sectors) >> 11));
+
+            config.hardfile[unit].present = 1;
+            return 1;
+        }
+    }
+    else
+    {
+        strncpy(filename, config.hardfile[unit].name, 8);
+        strcpy(&filename[8], "HDF");
+        hdf[unit].type = HDF_FILE;
+        hdf[unit].offset = 0;
+
+        if (filename[0])
+        {
+            if (FileOpen(&hdf[unit].file, filename))
+            {
+                hdf[unit].size = hdf[unit].file.size >> 9;
+                OpenSparseHardfile(&hdf[unit]); // sets the size of the emulated disk
+                GetHardfileGeometry(&hdf[unit]);
+
+                printf("HARDFILE %d:\r", unit);
+                printf("file: \"%.8s.%.3s\"\r", hdf[unit].file.name, &hdf[unit].file.name[8]);
+                printf("size: %lu (%lu MB)\r", hdf[unit].file.size, hdf[unit].file.size >> 20);
+                if (hdf[unit].sparse)
+                    printf("sparse: %lu MB, %lu of %lu blocks allocated\r", hdf[unit].size >> 11, hdf[unit].blocks, (hdf[unit].size + (1 << hdf[unit].block_shift) - 1) >> hdf[unit].block_shift);
+                printf("CHS: %u.%u.%u", hdf[unit].cylinders, hdf[unit].heads, hdf[unit].sectors);
+                printf(" (%lu MB)\r", ((((unsigned long) hdf[unit].cylinders) * hdf[unit].heads * hdf[unit].sectors) >> 11));
+
+                strcpy(&filename[8], "IDX");
+                time = GetTimer(0);
+                if (LoadHardfileIndex(&hdf[unit], filename))
+                {
+                    time = GetTimer(0) - time;
+                    printf("Hardfile index loaded in %lu ms\r", time >> 20);
+                }
+                else
+                {
+                    BuildHardfileIndex(&hdf[unit]);
+                    time = GetTimer(0) - time;
+                    printf("Hardfile indexed in %lu ms\r", time >> 20);
+
+                    if (SaveHardfileIndex(&hdf[unit], filename))
+                        printf("Hardfile index saved\r");
+                }
+
+                printf("Hardfile extents: %lu%s\r", hdf[unit].extents, hdf[unit].packed_size ? " (packed)" : "");
+                if (hdf[unit].tail.cluster)
+                    printf("Hardfile index is full, sectors from %lu are found through the cluster chain\r", hdf[unit].tail.sector);
+
+                hdf[unit].seeks = 0;
+                hdf[unit].seek_fat_reads = 0;
+
+                strcpy(&filename[8], "DLT");
+                if (OpenDelta(unit, filename))
+                    printf("Delta overlay: %lu KB changed\r", delta_hdf.blocks << (HDF_DELTA_BLOCK_SHIFT - 1));
+
+                config.hardfile[unit].present = 1;
+                return 1;
+            }
+        }
+    }
+
+    hdf[unit].size = 0;
+    config.hardfile[unit].present = 0;
     return 0;
 }
+
+unsigned char OpenDelta(unsigned char unit, char *name)
+{
+    // opens existing delta file of the hardfile, the hardfile becomes a read-only base image
+
+    fileTYPE file;
+
+    if (delta_unit != HDF_NO_DELTA)
+    {
+        if (FileOpen(&file, name)) // delta_hdf belongs to the other unit
+            printf("Delta overlay already used by unit %u!\r", delta_unit);
+        return 0;
+    }
+
+    if (!FileOpen(&delta_hdf.file, name))
+        return 0;
+
+    delta_hdf.type = HDF_FILE;
+    delta_hdf.offset = 0;
+    if (!OpenSparseHardfile(&delta_hdf) || delta_hdf.size != hdf[unit].size)
+    {
+        printf("Delta file doesn't match the hardfile!\r");
+        return 0;
+    }
+
+    BuildHardfileIndex(&delta_hdf);
+
+    delta_unit = unit;
+    hdf[unit].overlay = 1;
+    return 1;
+}
+
+unsigned char CreateDelta(unsigned char unit)
+{
+    // creates empty delta file for the hardfile (or empties an existing one) and activates the overlay
+
+    fileTYPE *file = &delta_hdf.file;
+    unsigned long map_size;
+    char filename[12];
+
+    if (delta_unit != HDF_NO_DELTA || hdf[unit].type != HDF_FILE || !hdf[unit].size)
+        return 0;
+
+    FlushWriteCache(); // buffered sectors have to reach the base image
+
+    map_size = (((hdf[unit].size + (1 << HDF_DELTA_BLOCK_SHIFT) - 1) >> HDF_DELTA_BLOCK_SHIFT) + HDF_SPARSE_MAP_ENTRIES - 1) / HDF_SPARSE_MAP_ENTRIES;
+
+    strncpy(filename, config.hardfile[unit].name, 8);
+    strcpy(&filename[8], "DLT");
+
+    if (FileOpen(file, filename))
+    {
+        if (file->size < (1 + map_size) << 9)
+        {
+            printf("Delta file is too small!\r");
+            return 0;
+        }
+    }
+    else
+    {
+        strncpy(file->name, filename, 11);
+        file->attributes = 0;
+        file->size = (1 + map_size) << 9;
+        if (!FileCreate(DIRECTORY_ROOT, file))
+            return 0;
+    }
+
+    delta_hdf.type = HDF_FILE;
+    delta_hdf.offset = 0;
+    delta_hdf.sparse = 1;
+    delta_hdf.block_shift = HDF_DELTA_BLOCK_SHIFT;
+    delta_hdf.size = hdf[unit].size;
+    delta_hdf.data_start = 1 + map_size;
+    delta_hdf.last_cluster = 0;
+
+    BuildHardfileIndex(&delta_hdf);
+
+    if (!SparseClear(&delta_hdf))
+        return 0;
+
+    delta_unit = unit;
+    hdf[unit].overlay = 1;
+    return 1;
+}
+
+unsigned char CommitDelta(void)
+{
+    // writes changed blocks to the base image and empties the delta
+    // the time depends only on the amount of changed data
+
+    hdfTYPE *pBase;
+    unsigned long lba;
+    unsigned long sector;
+    unsigned long i;
+
+    if (delta_unit == HDF_NO_DELTA)
+        return 0;
+
+    FlushWriteCache();
+
+    pBase = &hdf[delta_unit];
+    for (lba = 0; lba < pBase->size; lba += 1 << HDF_DELTA_BLOCK_SHIFT)
+    {
+        if (!SparseMap(&delta_hdf, lba, &sector))
+            return 0;
+
+        for (i = 0; sector && i < (1 << HDF_DELTA_BLOCK_SHIFT) && lba + i < pBase->size; i++)
+        {
+            if (!HardFileSeek(&delta_hdf, sector + i))
+                return 0;
+
+            if (!FileRead(&delta_hdf.file, delta_buffer))
+                return 0;
+
+            if (!HardFileWriteImage(pBase, lba + i, delta_buffer, 1))
+                return 0;
+        }
+    }
+
+    return SparseClear(&delta_hdf);
+}
+
+unsigned char DiscardDelta(void)
+{
+    // drops all changes made since the delta was created or committed, only the block map is cleared
+
+    if (delta_unit == HDF_NO_DELTA)
+        return 0;
+
+    FlushWriteCache();
+
+    return SparseClear(&delta_hdf);
+}
+
+void PrintHardfileStatistics(void)
+{
+    unsigned char unit;
+    unsigned long avg;
+
+    for (unit = 0; unit < 2; unit++)
+    {
+        if (hdf[unit].type == HDF_FILE && hdf[unit].size)
+        {
+            avg = hdf[unit].seeks ? hdf[unit].seek_fat_reads * 100 / hdf[unit].seeks : 0;
+            printf("HDD%u: %s, %lu seeks, %lu FAT reads, %lu.%02lu per seek\r", unit, hdf[unit].packed_size ? "packed extents" : "extents",
+                hdf[unit].seeks, hdf[unit].seek_fat_reads, avg / 100, avg % 100);
+        }
+    }
+}
+
+unsigned long TraceTime(void)
+{
+    // microsecond counter built on the PIT, its period counter wraps every 4096 ms
+    // so longer idle gaps between commands are shortened (commands never take that long)
+
+    unsigned long piir = *AT91C_PITC_PIIR;
+    unsigned long now = (piir >> 20) * 1000 + (piir & AT91C_PITC_CPIV) / (MCLK / 16 / 1000000);
+
+    trace_time += now >= trace_last ? now - trace_last : now + 4096000 - trace_last;
+    trace_last = now;
+
+    return(trace_time);
+}
+
+void TraceCommand(unsigned char command, unsigned char unit, unsigned long lba, unsigned char count, unsigned char features, unsigned long start)
+{
+    tracerecordTYPE *p = &trace[trace_head & (IDE_TRACE_SIZE - 1)];
+
+    p->time = start;
+    p->duration = TraceTime() - start;
+    p->lba = lba;
+    p->count = count;
+    p->command = command;
+    p->unit = unit;
+    p->features = features;
+
+    trace_head++;
+
+    if (trace_capture && trace_head - trace_tail > IDE_TRACE_SIZE) // oldest record not yet written is overwritten
+    {
+        trace_tail++;
+        trace_dropped++;
+    }
+}
+
+void PrintTrace(void)
+{
+    // dumps the ring buffer in the text format accepted by the replay tool
+
+    unsigned long i;
+    tracerecordTYPE *p;
+
+    i = trace_head > IDE_TRACE_SIZE ? trace_head - IDE_TRACE_SIZE : 0;
+    for (; i < trace_head; i++)
+    {
+        p = &trace[i & (IDE_TRACE_SIZE - 1)];
+        printf("IDETRACE %lu %lu %02X %u %lu %u %02X\r", p->time, p->duration, p->command, p->unit, p->lba, p->count, p->features);
+    }
+}
+
+unsigned char StartTraceCapture(void)
+{
+    // records are written to IDETRACE.TRC on the card between IDE commands
+
+    char *filename = "IDETRACETRC";
+
+    if (trace_capture)
+        return(1);
+
+    if (FileOpen(&trace_file, filename))
+    {
+        if (trace_file.size < (1 + IDE_TRACE_FILE_SECTORS) << 9)
+        {
+            printf("Trace file is too small!\r");
+            return(0);
+        }
+    }
+    else
+    {
+        memcpy(trace_file.name, filename, 11); // 8.3 name without terminator
+        trace_file.attributes = 0;
+        trace_file.size = (1 + IDE_TRACE_FILE_SECTORS) << 9;
+        if (!FileCreate(DIRECTORY_ROOT, &trace_file))
+            return(0);
+    }
+
+    if (!FileSeek(&trace_file, 1, SEEK_SET))
+        return(0);
+
+    trace_tail = trace_head;
+    trace_dropped = 0;
+    trace_records = 0;
+    trace_capture = 1;
+
+    printf("IDE trace capture started\r");
+    return(1);
+}
+
+void WriteTraceSector(void)
+{
+    // writes the oldest records (one sector, the last one can be partial) to the capture file
+
+    unsigned long i;
+    unsigned long n = trace_head - trace_tail;
+
+    if (n > 512 / sizeof(tracerecordTYPE))
+        n = 512 / sizeof(tracerecordTYPE);
+
+    memset(sector_buffer, 0, sizeof(sector_buffer));
+    for (i = 0; i < n; i++)
+        memcpy(&sector_buffer[i * sizeof(tracerecordTYPE)], &trace[(trace_tail + i) & (IDE_TRACE_SIZE - 1)], sizeof(tracerecordTYPE));
+
+    if (!FileWrite(&trace_file, sector_buffer))
+    {
+        printf("Trace file write failed!\r");
+        trace_capture = 0;
+        return;
+    }
+
+    trace_tail += n;
+    trace_records += n;
+
+    if (trace_records >= IDE_TRACE_FILE_SECTORS * (512 / sizeof(tracerecordTYPE)))
+    {
+        printf("Trace file is full\r");
+        StopTraceCapture();
+    }
+    else if (!FileNextSector(&trace_file))
+    {
+        printf("Trace file seek failed!\r");
+        trace_capture = 0;
+    }
+}
+
+void StopTraceCapture(void)
+{
+    traceheaderTYPE *header = (traceheaderTYPE*)sector_buffer;
+
+    if (!trace_capture)
+        return;
+
+    if (trace_head != trace_tail && trace_records < IDE_TRACE_FILE_SECTORS * (512 / sizeof(tracerecordTYPE)))
+    {
+        WriteTraceSector(); // partial last sector
+        if (!trace_capture) // already stopped (write error or file full)
+            return;
+    }
+
+    trace_capture = 0;
+
+    memset(sector_buffer, 0, sizeof(sector_buffer));
+    memcpy(header->id, IDE_TRACE_ID, sizeof(header->id));
+    header->records = trace_records;
+    header->dropped = trace_dropped;
+
+    if (FileSeek(&trace_file, 0, SEEK_SET) && FileWrite(&trace_file, sector_buffer))
+        printf("IDE trace capture stopped: %lu records, %lu dropped\r", trace_records, trace_dropped);
+    else
+        printf("Trace file header write failed!\r");
+}
@@ -22,26 +22,164 @@
 #define ACMD_READ_MULTIPLE 0xC4
 #define ACMD_WRITE_MULTIPLE 0xC5
 #define ACMD_SET_MULTIPLE_MODE 0xC6
+#define ACMD_FLUSH_CACHE 0xE7
+#define ACMD_SET_FEATURES 0xEF
+
+#define SETFEATURES_WRITE_CACHE_ON 0x02
+#define SETFEATURES_WRITE_CACHE_OFF 0x82
+
+#define WRITE_CACHE_SECTORS 8       // size of write-back buffer (contiguous sectors of one unit)
+#define WRITE_CACHE_TIMEOUT 100     // buffered sectors are written after this time (ms) without new writes
+
+// hardfile types (stored in config.hardfile[].enabled)
+#define HDF_DISABLED 0
+#define HDF_FILE 1                  // HDF file in the root directory of the FAT partition
+#define HDF_CARDPART(n) (1 + (n))   // raw MBR partition n (1-3) of the card, partition 0 holds the FAT volume
+#define HDF_CARDPART_MAX HDF_CARDPART(3)
+
+#define IDE_DRIVEHEAD_LBA 0x40      // drive/head register LBA addressing flag
+
+#define IDE_TRACE_SIZE 128          // ring buffer of recent commands (power of two)
+#define IDE_TRACE_ID "MNMGTRC1"
+#define IDE_TRACE_FILE_SECTORS 2048 // capture file size without header sector (32 records per sector)
+#define IDE_TRACE_FLUSH 0x01        // pseudo command: write-back buffer flushed after timeout (not an ATA opcode)
+
+#define HDF_MAX_EXTENTS 512         // extent table size, it's packed in place when the hardfile has more fragments
+#define HDF_PACKED_BLOCK 64         // packed extent table is searched in blocks of this size (power of two)
+
+#define HDF_SPARSE_ID "MNMGSPR2"
+#define HDF_SPARSE_MAP_ENTRIES 128  // block map entries per sector
+#define HDF_DELTA_BLOCK_SHIFT 3     // delta overlay block size (8 sectors, same as write-back buffer)
+#define HDF_NO_DELTA 0xFF           // delta_unit when no overlay is active
+
+typedef struct
+{
+    unsigned long  sector;          // file offset of the extent (in sectors)
+    unsigned long  cluster;         // first cluster of the extent
+} extentTYPE;
 
 typedef struct
 {
     fileTYPE       file;
+    unsigned char  type;
+    unsigned long  offset;          // start sector of raw card partition
+    unsigned long  size;            // size in sectors
     unsigned short cylinders;
     unsigned short heads;
     unsigned short sectors;
     unsigned short sectors_per_block;
-    unsigned long  index[1024];
-    unsigned long  index_size;
+    union
+    {
+        extentTYPE     extent[HDF_MAX_EXTENTS]; // runs of contiguous clusters
+        unsigned char  packed[HDF_MAX_EXTENTS * sizeof(extentTYPE)]; // the same runs packed (used when the hardfile is too fragmented)
+    };
+    unsigned long  extents;         // number of extents
+    unsigned long  packed_size;     // bytes used in packed[], 0 when extent[] is used
+    extentTYPE     last_extent;     // last packed extent
+    extentTYPE     tail;            // first extent not in the index (cluster 0 when all extents are indexed)
+    unsigned long  seeks;           // seek statistics
+    unsigned long  seek_fat_reads;
+    unsigned char  sparse;          // sparse container, size is the size of the emulated disk not of the file
+    unsigned char  block_shift;     // sparse data block size (log2 of sectors)
+    unsigned long  data_start;      // file sector of the first sparse data block
+    unsigned long  blocks;          // number of allocated sparse data blocks
+    unsigned long  last_cluster;    // last cluster of the container file (0 when not known yet)
+    unsigned long  map_sector;      // block map sector held in map[]
+    unsigned long  map[HDF_SPARSE_MAP_ENTRIES];
+    unsigned char  overlay;         // hardfile is read-only base image, changed blocks are kept in delta_hdf
 } hdfTYPE;
 
+// header of hardfile index file (stored next to the hardfile with IDX extension)
+typedef struct
+{
+    char           id[8];
+    unsigned long  start_cluster;   // first cluster of the hardfile
+    unsigned long  size;            // size of the hardfile
+    unsigned long  extents;
+    unsigned long  packed_size;
+    extentTYPE     last_extent;
+    extentTYPE     tail;
+} hdfindexTYPE;
+
+// IDE command trace record (32 records per sector)
+typedef struct
+{
+    unsigned long  time;            // start of the command (microseconds)
+    unsigned long  duration;        // processing time (microseconds)
+    unsigned long  lba;
+    unsigned char  count;           // sector count register (0 means 256 for read/write commands)
+    unsigned char  command;         // ATA command or IDE_TRACE_FLUSH
+    unsigned char  unit;
+    unsigned char  features;        // features register (SET FEATURES subcommand)
+} tracerecordTYPE;
+
+// header of trace capture file (IDETRACE.TRC), records follow from the second sector
+typedef struct
+{
+    char           id[8];
+    unsigned long  records;
+    unsigned long  dropped;         // records lost because the ring buffer was not written in time
+} traceheaderTYPE;
+
+#define HDF_INDEX_ID "MNMGIDX4"
+#define HDF_INDEX_FILE_SIZE (512 + HDF_MAX_EXTENTS * 8) // header sector followed by extent table
+
+// header of sparse hardfile container (first sector of the file)
+// it is followed by the block map and the allocated data blocks
+// map entry n > 0 points to the n-th data block of the container, blocks with 0 entry read as zeros
+// (or from the base image when the container is a delta overlay, <name>.DLT next to <name>.HDF)
+typedef struct
+{
+    char           id[8];
+    unsigned long  size;            // size of the emulated disk in sectors
+    unsigned long  block_size;      // sectors per data block (power of two)
+    unsigned long  map_size;        // number of block map sectors
+    unsigned long  blocks;          // data blocks in use, the file can be longer when a delta has been discarded
+} sparsehdfTYPE;
+
 void IdentifyDevice(unsigned short *pBuffer, unsigned char unit);
 unsigned long chs2lba(unsigned short cylinder, unsigned char head, unsigned short sector, unsigned char unit);
 void WriteTaskFile(unsigned char error, unsigned char sector_count, unsigned char sector_number, unsigned char cylinder_low, unsigned char cylinder_high, unsigned char drive_head);
 void WriteStatus(unsigned char status);
 void HandleHDD(unsigned char c1, unsigned char c2);
+void HandleHDDBackground(void);
 void GetHardfileGeometry(hdfTYPE *hdf);
+unsigned char PackExtent(hdfTYPE *hdf, unsigned long sector, unsigned long cluster, unsigned long limit);
+void PackExtentTable(hdfTYPE *hdf);
+unsigned char AddExtent(hdfTYPE *hdf, unsigned long sector, unsigned long cluster);
 void BuildHardfileIndex(hdfTYPE *hdf);
+unsigned char CheckExtentLink(hdfTYPE *hdf, extentTYPE *previous, unsigned long sector, unsigned long cluster);
+unsigned char CheckHardfileIndex(hdfTYPE *hdf);
+unsigned char LoadHardfileIndex(hdfTYPE *hdf, char *name);
+unsigned char SaveHardfileIndex(hdfTYPE *hdf, char *name);
 unsigned char HardFileSeek(hdfTYPE *hdf, unsigned long lba);
+unsigned char OpenSparseHardfile(hdfTYPE *hdf);
+unsigned char SparseMap(hdfTYPE *hdf, unsigned long lba, unsigned long *sector);
+unsigned char SparseWriteHeader(hdfTYPE *hdf);
+unsigned char SparseClear(hdfTYPE *hdf);
+unsigned char SparseAllocate(hdfTYPE *hdf, unsigned long lba, hdfTYPE *base, unsigned char fill);
+unsigned char SparseRead(hdfTYPE *hdf, unsigned long lba, unsigned char *pBuffer, unsigned long count, hdfTYPE *base);
+unsigned char SparseWrite(hdfTYPE *hdf, unsigned long lba, unsigned char *pBuffer, unsigned long count, hdfTYPE *base);
+unsigned char HardFileReadImage(hdfTYPE *hdf, unsigned long lba, unsigned char *pBuffer, unsigned long count);
+unsigned char HardFileWriteImage(hdfTYPE *hdf, unsigned long lba, unsigned char *pBuffer, unsigned long count);
+unsigned char HardFileRead(hdfTYPE *hdf, unsigned long lba, unsigned char *pBuffer, unsigned long count);
+unsigned char HardFileWrite(hdfTYPE *hdf, unsigned long lba, unsigned char *pBuffer, unsigned long count);
+unsigned char *GetWriteBuffer(unsigned char unit, unsigned long lba);
+void WriteBufferedSector(unsigned char unit, unsigned long lba, unsigned char *pBuffer);
+void FlushWriteCache(void);
+void FlushWriteCacheRange(unsigned char unit, unsigned long lba, unsigned long count);
+unsigned char OpenCardPartition(hdfTYPE *hdf, unsigned char partition);
 unsigned char OpenHardfile(unsigned char unit);
+unsigned char OpenDelta(unsigned char unit, char *name);
+unsigned char CreateDelta(unsigned char unit);
+unsigned char CommitDelta(void);
+unsigned char DiscardDelta(void);
+void PrintHardfileStatistics(void);
+unsigned long TraceTime(void);
+void TraceCommand(unsigned char command, unsigned char unit, unsigned long lba, unsigned char count, unsigned char features, unsigned long start);
+void PrintTrace(void);
+unsigned char StartTraceCapture(void);
+void WriteTraceSector(void);
+void StopTraceCapture(void);
 
 
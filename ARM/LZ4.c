@@ -0,0 +1,259 @@
+/*
+Copyright 2010 Jakub Bednarski
+
+This file is part of Minimig
+
+Minimig is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+(at your option) any later version.
+
+Minimig is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+// 2010-09-29   - initial version
+// 2010-10-05   - compressed ROM and FPGA core files, streaming decompression and benchmark
+// 2010-10-07   - lengths are checked against the space left in the output, reading past the end of the file fails
+//
+// LZ4 block format (no frame): every sequence starts with a token byte, its high nibble is the literal length
+// and its low nibble the match length minus 4, value 15 in either nibble is extended by following bytes
+// (added to the length till a byte other than 255), literals follow the literal length,
+// then comes a 16-bit little endian match offset (back reference into the decompressed data) and the match length extension.
+// The last sequence of a block has literals only.
+//
+// Compressed data is read through sector_buffer, the block may start at any byte of a sector.
+//
+// Compressed ROM and FPGA core files keep their original names and are recognized by a 16-byte header:
+// "MNMGLZ4F" id, 32-bit little endian uncompressed size and 4 reserved bytes,
+// followed by LZ4 blocks which decompress to LZ4_CHUNK_SIZE bytes each (the last one may be shorter).
+
+#include "stdio.h"
+#include "string.h"
+#include "AT91SAM7S256.h"
+#include "hardware.h"
+#include "FAT.h"
+#include "FDD.h"
+#include "LZ4.h"
+
+extern unsigned char sector_buffer[512];
+
+fileTYPE *lz4_file;      // compressed file
+unsigned char *lz4_in;   // next compressed byte in the sector buffer
+
+unsigned char LZ4_NextSector(void)
+{
+    // reads the next sector of the compressed file into the sector buffer
+    // returns 0 at the end of the file (the cluster chain can't be followed any further) or if the read fails
+    if (((lz4_file->sector + 1) << 9) >= lz4_file->size)
+        return(0);
+
+    if (!FileNextSector(lz4_file) || !FileRead(lz4_file, sector_buffer))
+        return(0);
+
+    lz4_in = sector_buffer;
+    return(1);
+}
+
+unsigned char LZ4_ReadByte(unsigned char *c)
+{
+    // returns 0 if the compressed data ends before the block
+    if (lz4_in == &sector_buffer[sizeof(sector_buffer)]) // end of the sector, read the next one
+        if (!LZ4_NextSector())
+            return(0);
+
+    *c = *lz4_in++;
+    return(1);
+}
+
+unsigned char LZ4_ReadLength(unsigned long *len, unsigned long limit)
+{
+    // adds length extension bytes if the token nibble is 15
+    // returns 0 as soon as the length exceeds limit (space left in the output) or the compressed data ends
+    unsigned char c;
+
+    if (*len == 15)
+    {
+        do
+        {
+            if (!LZ4_ReadByte(&c))
+                return(0);
+            *len += c;
+            if (*len > limit)
+                return(0);
+        }
+        while (c == 255);
+    }
+    return(*len <= limit);
+}
+
+unsigned char LZ4_DecompressBlock(unsigned char *pOut, unsigned long nSize)
+{
+    // decompresses the next block of the current compressed stream (lz4_file, lz4_in), the block must decompress to nSize bytes
+    // returns 0 if the data is corrupted
+    unsigned char *p = pOut;
+    unsigned char *match;
+    unsigned char token;
+    unsigned long len;
+    unsigned long n;
+    unsigned char lo;
+    unsigned char hi;
+    unsigned short offset;
+
+    while (1)
+    {
+        if (!LZ4_ReadByte(&token))
+            return(0);
+
+        // literals are copied from the sector buffer in as large pieces as possible
+        len = token >> 4;
+        if (!LZ4_ReadLength(&len, nSize - (p - pOut)))
+            return(0);
+
+        while (len)
+        {
+            if (lz4_in == &sector_buffer[sizeof(sector_buffer)])
+                if (!LZ4_NextSector())
+                    return(0);
+
+            n = &sector_buffer[sizeof(sector_buffer)] - lz4_in;
+            if (n > len)
+                n = len;
+            memcpy(p, lz4_in, n);
+            p += n;
+            lz4_in += n;
+            len -= n;
+        }
+
+        if (p == pOut + nSize) // last sequence
+            break;
+
+        if (!LZ4_ReadByte(&lo) || !LZ4_ReadByte(&hi))
+            return(0);
+        offset = lo | hi << 8;
+        if (offset == 0 || offset > p - pOut)
+            return(0);
+
+        // match is at least 4 bytes long
+        len = token & 0x0F;
+        if (nSize - (p - pOut) < 4 || !LZ4_ReadLength(&len, nSize - (p - pOut) - 4))
+            return(0);
+        len += 4;
+
+        // match may overlap the data being written (repeated patterns), copied byte by byte
+        match = p - offset;
+        while (len--)
+            *p++ = *match++;
+    }
+
+    return(1);
+}
+
+unsigned char LZ4_Decompress(fileTYPE *file, unsigned short *pOffset, unsigned char *pOut, unsigned long nSize)
+{
+    // decompresses one block starting at byte *pOffset of the current file sector, the block must decompress to nSize bytes
+    // on return the file pointer and *pOffset point to the first byte following the block
+    // returns 0 if the data is corrupted
+    lz4_file = file;
+    if (!FileRead(file, sector_buffer))
+        return(0);
+    lz4_in = &sector_buffer[*pOffset];
+
+    if (!LZ4_DecompressBlock(pOut, nSize))
+        return(0);
+
+    if (lz4_in == &sector_buffer[sizeof(sector_buffer)]) // block ends with the sector
+    {
+        FileNextSector(file);
+        lz4_in = sector_buffer;
+    }
+    *pOffset = lz4_in - sector_buffer;
+
+    return(1);
+}
+
+unsigned long LZ4_FileSize(fileTYPE *file)
+{
+    // checks if the file (positioned at its beginning) is a compressed ROM or FPGA core file
+    // returns its uncompressed size and prepares the stream for LZ4_DecompressBlock() or 0 if the file is not compressed
+    unsigned long size;
+
+    if (file->size <= LZ4_HEADER_SIZE)
+        return(0);
+
+    if (!FileRead(file, sector_buffer))
+        return(0);
+
+    if (strncmp((char*)sector_buffer, LZ4_FILE_ID, 8) != 0)
+        return(0);
+
+    size = sector_buffer[8] | sector_buffer[9] << 8 | sector_buffer[10] << 16 | sector_buffer[11] << 24;
+
+    lz4_file = file;
+    lz4_in = &sector_buffer[LZ4_HEADER_SIZE];
+
+    return(size);
+}
+
+void LZ4_Benchmark(fileTYPE *file)
+{
+    // compares boot time of a compressed file with the time needed to read its uncompressed version at the current SPI clock
+    // the raw read time is extrapolated from the read speed of the compressed file, the file pointer is left at the beginning
+    unsigned char *buffer = GetTransferBuffer(); // LZ4_CHUNK_SIZE bytes
+    unsigned long size;
+    unsigned long n;
+    unsigned long t;
+    unsigned long time;
+    unsigned long read_time;
+    unsigned long decompress_time;
+    unsigned long raw_time;
+
+    size = LZ4_FileSize(file);
+    if (!size)
+    {
+        printf("LZ4: %.11s is not compressed\r", file->name);
+        return;
+    }
+
+    // reading of the compressed data only
+    time = GetTimer(0);
+    for (t = 0; t < file->size; t += n)
+    {
+        n = file->size - t;
+        if (n > LZ4_CHUNK_SIZE)
+            n = LZ4_CHUNK_SIZE;
+        FileReadEx(file, buffer, (n + 511) >> 9);
+    }
+    read_time = (GetTimer(0) - time) >> 20;
+
+    // reading with decompression
+    FileSeek(file, 0, SEEK_SET);
+    LZ4_FileSize(file);
+    time = GetTimer(0);
+    for (t = 0; t < size; t += n)
+    {
+        n = size - t;
+        if (n > LZ4_CHUNK_SIZE)
+            n = LZ4_CHUNK_SIZE;
+        if (!LZ4_DecompressBlock(buffer, n))
+        {
+            printf("LZ4: %.11s is corrupted!\r", file->name);
+            break;
+        }
+    }
+    decompress_time = (GetTimer(0) - time) >> 20;
+
+    raw_time = read_time * (size >> 9) / ((file->size + 511) >> 9);
+
+    printf("LZ4: %.11s %lu -> %lu bytes\r", file->name, file->size, size);
+    printf("LZ4: compressed %lu ms (read %lu ms), raw read %lu ms (estimated) at %lu MHz SPI\r", decompress_time, read_time, raw_time, (unsigned long)(MCLK / ((AT91C_SPI_CSR[0] & AT91C_SPI_SCBR) >> 8) / 1000000));
+    printf("LZ4: %s\r", decompress_time < raw_time ? "decompression is faster" : "raw read is faster");
+
+    FileSeek(file, 0, SEEK_SET);
+}
@@ -0,0 +1,10 @@
+// LZ4 block decompression from files (compressed ADF images, compressed ROM and FPGA core files)
+
+#define LZ4_FILE_ID "MNMGLZ4F"  // compressed ROM and FPGA core file id
+#define LZ4_HEADER_SIZE 16
+#define LZ4_CHUNK_SIZE 2048     // uncompressed size of a compressed ROM and FPGA core file block
+
+unsigned char LZ4_Decompress(fileTYPE *file, unsigned short *pOffset, unsigned char *pOut, unsigned long nSize);
+unsigned char LZ4_DecompressBlock(unsigned char *pOut, unsigned long nSize);
+unsigned long LZ4_FileSize(fileTYPE *file);
+void LZ4_Benchmark(fileTYPE *file);
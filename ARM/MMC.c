@@ -22,6 +22,9 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 // 2008-10-03 - adaptation for ARM controller
 // 2009-07-23 - clean-up and some optimizations
 // 2009-11-22 - multiple sector read implemented
+// 2010-09-15 - multiple sector write implemented
+// 2010-09-16 - multiple sector write can clear blocks (NULL buffer)
+// 2010-10-06 - multiple sector write is always ended with Stop Tran token
 
 
 #include "AT91SAM7S256.h"
@@ -391,6 +394,80 @@ unsigned char MMC_Write(unsigned long lba, unsigned char *pWriteBuffer)
     return(1);
 }
 
+// write multiple 512-byte blocks, zeros are written if pWriteBuffer is NULL
+unsigned char MMC_WriteMultiple(unsigned long lba, unsigned char *pWriteBuffer, unsigned long nBlockCount)
+{
+    unsigned long i;
+    unsigned char rc = 1;
+
+    if (CardType != CARDTYPE_SDHC) // SDHC cards are addressed in sectors not bytes
+        lba = lba << 9; // otherwise convert sector adddress to byte address
+
+    EnableCard();
+
+    if (MMC_Command(CMD25, lba))
+    {
+        printf("CMD25 (WRITE_MULTIPLE_BLOCK): invalid response 0x%02X (lba=%lu)\r", response, lba);
+        DisableCard();
+        return(0);
+    }
+
+    SPI(0xFF); // one byte gap
+
+    while (nBlockCount--)
+    {
+        SPI(0xFC); // send Data Token for multiple block write
+
+        // send sector bytes
+        for (i = 0; i < 512; i++)
+             SPI(pWriteBuffer ? *(pWriteBuffer++) : 0x00);
+
+        SPI(0xFF); // send CRC lo byte
+        SPI(0xFF); // send CRC hi byte
+
+        response = SPI(0xFF); // read packet response
+        response &= 0x1F;
+        if (response != 0x05)
+        {
+            printf("CMD25 (WRITE_MULTIPLE_BLOCK): invalid status 0x%02X (lba=%lu)\r", response, lba);
+            rc = 0;
+            break;
+        }
+
+        timeout = 0;
+        while (SPI(0xFF) == 0x00) // wait until the card is not busy
+        {
+            if (timeout++ >= 1000000)
+            {
+                printf("CMD25 (WRITE_MULTIPLE_BLOCK): busy wait timeout! (lba=%lu)\r", lba);
+                rc = 0;
+                break;
+            }
+        }
+
+        if (!rc)
+            break;
+    }
+
+    // the card leaves multiple block write mode only after Stop Tran token (also when a block has failed)
+    SPI(0xFD); // send Stop Tran token
+    SPI(0xFF); // skip one byte before busy signal
+
+    timeout = 0;
+    while (SPI(0xFF) == 0x00) // wait until the card is not busy
+    {
+        if (timeout++ >= 1000000)
+        {
+            printf("CMD25 (WRITE_MULTIPLE_BLOCK): stop busy wait timeout! (lba=%lu)\r", lba);
+            DisableCard();
+            return(0);
+        }
+    }
+
+    DisableCard();
+    return(rc);
+}
+
 #pragma section_code_init
 unsigned char MMC_Command(unsigned char cmd, unsigned long arg)
 {
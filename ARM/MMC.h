@@ -74,4 +74,5 @@ unsigned char MMC_Init(void);
 unsigned char MMC_Read(unsigned long lba, unsigned char *pReadBuffer);
 unsigned char MMC_Write(unsigned long lba, unsigned char *pWriteBuffer);
 unsigned char MMC_ReadMultiple(unsigned long lba, unsigned char *pReadBuffer, unsigned long nBlockCount);
+unsigned char MMC_WriteMultiple(unsigned long lba, unsigned char *pWriteBuffer, unsigned long nBlockCount);
 
@@ -441,14 +441,9 @@ void OsdClear(void)
 
 void OsdWaitVBL(void)
 {
-    unsigned long pioa_old = 0;
-    unsigned long pioa = 0;
+    unsigned long vsync = GetVsync();
 
-    while ((~pioa ^ pioa_old) & INIT_B)
-    {
-        pioa_old = pioa;
-        pioa = *AT91C_PIOA_PDSR;
-    }
+    while (GetVsync() == vsync);
 }
 
 // enable displaying of OSD
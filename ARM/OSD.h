@@ -67,6 +67,8 @@
 
 #define CONFIG_FLOPPY1X  0
 #define CONFIG_FLOPPY2X  1
+#define CONFIG_FLOPPY4X  2
+#define CONFIG_FLOPPYMAX 3
 
 #define RESET_NORMAL 0
 #define RESET_BOOTLOADER 1
@@ -24,6 +24,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "hardware.h"
 #include "FAT.h"
 #include "firmware.h"
+#include "tasks.h"
 
 /* polynomial 0xEDB88320 */
 const unsigned long crc32_table[256] =
@@ -113,6 +114,7 @@ unsigned char CheckFirmware(fileTYPE *file, char *name)
                             else
                                read_size = size;
 
+                            Yield(TASK_FDD | TASK_IDE);
                             FileNextSector(file);
                             FileRead(file, sector_buffer);
                             crc = CalculateCRC32(crc, sector_buffer, read_size);
@@ -197,3 +197,61 @@ void WaitTimer(unsigned long time)
     time = GetTimer(time);
     while (!CheckTimer(time));
 }
+
+unsigned char fpga_request; // INIT_B change not yet handled by the main loop
+
+// INIT_B is toggled by the FPGA on every vertical sync and pulsed for 1us on every new floppy/hdd request
+// PIO input change detection latches these changes and the AIC wakes up the processor from idle mode
+// IRQ stays masked in the core so no interrupt handler is needed
+void FpgaRequest_Init(void)
+{
+    *AT91C_PIOA_ISR; // clear changes from FPGA configuration
+    *AT91C_PIOA_IER = INIT_B;
+    AT91C_AIC_SMR[AT91C_ID_PIOA] = AT91C_AIC_SRCTYPE_INT_HIGH_LEVEL;
+    *AT91C_AIC_IECR = 1 << AT91C_ID_PIOA;
+    fpga_request = 1; // poll FPGA status at least once
+}
+
+void LatchFpgaRequest(void)
+{
+    // reading ISR clears the change so it has to be remembered for the main loop
+    if (*AT91C_PIOA_ISR & INIT_B)
+        fpga_request = 1;
+}
+
+unsigned char CheckFpgaRequest(void)
+{
+    LatchFpgaRequest();
+    if (fpga_request)
+    {
+        fpga_request = 0;
+        return(1);
+    }
+    return(0);
+}
+
+void WaitFpgaRequest(void)
+{
+    // processor clock is stopped until INIT_B changes, returns at once if a change is already latched
+    *AT91C_PMC_SCDR = AT91C_PMC_PCK;
+}
+
+unsigned long GetVsync(void)
+{
+    // returns INIT_B level toggled by the FPGA on every vertical sync
+    // request pulses are filtered out: the level has to stay unchanged for about 3us
+    unsigned long vsync = *AT91C_PIOA_PDSR & INIT_B;
+    unsigned char n = 0;
+
+    while (n < 16)
+    {
+        if ((*AT91C_PIOA_PDSR & INIT_B) == vsync)
+            n++;
+        else
+        {
+            vsync ^= INIT_B;
+            n = 0;
+        }
+    }
+    return(vsync);
+}
@@ -34,5 +34,10 @@ void Timer_Init(void);
 unsigned long GetTimer(unsigned long offset);
 unsigned long CheckTimer(unsigned long t);
 void WaitTimer(unsigned long time);
+void FpgaRequest_Init(void);
+void LatchFpgaRequest(void);
+unsigned char CheckFpgaRequest(void);
+void WaitFpgaRequest(void);
+unsigned long GetVsync(void);
 
 
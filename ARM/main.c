@@ -35,6 +35,10 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 //              - added support for OSD vsync
 // 2010-08-15   - support for joystick emulation
 // 2010-08-18   - clean-up
+// 2010-09-18   - FPGA requests handled on INIT_B changes, idle mode in between
+// 2010-09-19   - main loop moved to the task scheduler (tasks.c)
+// 2010-10-05   - LZ4 compressed ROM files, F3 at boot benchmarks compressed files against raw reads
+// 2010-10-07   - failed Kickstart upload falls back to KICK.ROM like a missing one
 
 #include "AT91SAM7S256.h"
 #include "stdio.h"
@@ -50,6 +54,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "firmware.h"
 #include "menu.h"
 #include "config.h"
+#include "tasks.h"
+#include "LZ4.h"
 
 const char version[] = {"$VER:AYQ100818"};
 
@@ -57,6 +63,7 @@ extern char *config_filter_msg[];
 extern char *config_memory_chip_msg[];
 extern char *config_memory_slow_msg[];
 extern char *config_scanline_msg[];
+extern char *config_floppy_speed_msg[];
 
 configTYPE config;
 fileTYPE file;
@@ -65,6 +72,7 @@ extern hdfTYPE hdf[2];
 
 unsigned char Error;
 char s[40];
+unsigned char lz4_benchmark; // compressed boot files are benchmarked before upload (F3 pressed at boot)
 
 void FatalError(unsigned long error)
 {
@@ -88,21 +96,37 @@ void FatalError(unsigned long error)
 char UploadKickstart(char *name)
 {
     char filename[12];
+    unsigned long size;
     strncpy(filename, name, 8); // copy base name
     strcpy(&filename[8], "ROM"); // add extension
 
     if (FileOpen(&file, filename))
     {
-        if (file.size == 0x80000)
+        if (lz4_benchmark)
+            LZ4_Benchmark(&file);
+
+        size = LZ4_FileSize(&file); // uncompressed size of a compressed ROM file
+        if (!size)
+            size = file.size;
+
+        if (size == 0x80000)
         { // 512KB Kickstart ROM
             BootPrint("Uploading 512 KB Kickstart...");
-            BootUpload(&file, 0xF8, 0x08);
+            if (BootUpload(&file, 0xF8, 0x08) != 0)
+            {
+                BootPrint("Kickstart upload failed!");
+                return(0);
+            }
             return(1);
         }
-        else if (file.size == 0x40000)
+        else if (size == 0x40000)
         { // 256KB Kickstart ROM
             BootPrint("Uploading 256 KB Kickstart...");
-            BootUpload(&file, 0xF8, 0x04);
+            if (BootUpload(&file, 0xF8, 0x04) != 0)
+            {
+                BootPrint("Kickstart upload failed!");
+                return(0);
+            }
             return(1);
         }
         else
@@ -151,7 +175,7 @@ unsigned char LoadConfiguration(char *filename)
     strncpy(config.kickstart.name, "KICK    ", sizeof(config.kickstart.name));
     config.kickstart.long_name[0] = 0;
     config.memory = 0x05;
-    config.hardfile[0].enabled = 1;
+    config.hardfile[0].enabled = HDF_FILE;
     strncpy(config.hardfile[0].name, "HARDFILE", sizeof(config.hardfile[0].name));
     return(0);
 }
@@ -202,31 +226,13 @@ unsigned char SaveConfiguration(char *filename)
     return(0);
 }
 
-void HandleFpga(void)
-{
-    unsigned char  c1, c2;
-
-    EnableFpga();
-    c1 = SPI(0); // cmd request and drive number
-    c2 = SPI(0); // track number
-    SPI(0);
-    SPI(0);
-    SPI(0);
-    SPI(0);
-    DisableFpga();
-
-    HandleFDD(c1, c2);
-    HandleHDD(c1, c2);
-
-    UpdateDriveStatus();
-}
-
 void main(void)
 {
     unsigned char rc;
     unsigned char key;
     unsigned long time;
     unsigned short spiclk;
+    unsigned long size;
     //unsigned char CSD[16];
 
     DISKLED_ON;
@@ -278,6 +284,13 @@ void main(void)
     if (key == KEY_F2)
        config.chipset &= ~CONFIG_NTSC; // force PAL mode if F2 pressed
 
+    if (key == KEY_F3)
+    { // benchmark compressed boot files if F3 pressed
+        lz4_benchmark = 1;
+        if (FileOpen(&file, "MINIMIG1BIN"))
+            LZ4_Benchmark(&file);
+    }
+
     ConfigChipset(config.chipset | CONFIG_TURBO); // set CPU in turbo mode
 
     OsdReset(RESET_BOOTLOADER);
@@ -302,7 +315,7 @@ void main(void)
 
     sprintf(s, "Floppy drives : %u", config.floppy.drives + 1);
     BootPrint(s);
-    sprintf(s, "Floppy speed  : %s", config.floppy.speed ? "fast": "normal");
+    sprintf(s, "Floppy speed  : %s", config_floppy_speed_msg[config.floppy.speed & 0x03]);
     BootPrint(s);
 
     BootPrint("");
@@ -318,7 +331,14 @@ void main(void)
     {
         if (FileOpen(&file, "AR3     ROM"))
         {
-            if (file.size == 0x40000)
+            if (lz4_benchmark)
+                LZ4_Benchmark(&file);
+
+            size = LZ4_FileSize(&file); // uncompressed size of a compressed ROM file
+            if (!size)
+                size = file.size;
+
+            if (size == 0x40000)
             { // 256 KB Action Replay 3 ROM
                 BootPrint("\nUploading Action Replay ROM...");
                 BootUpload(&file, 0x40, 0x04);
@@ -335,7 +355,10 @@ void main(void)
     if (OpenHardfile(0))
     {
 
-        sprintf(s, "\nHardfile 0: %.8s.%.3s", hdf[0].file.name, &hdf[0].file.name[8]);
+        if (hdf[0].type == HDF_FILE)
+            sprintf(s, "\nHardfile 0: %.8s.%.3s", hdf[0].file.name, &hdf[0].file.name[8]);
+        else
+            sprintf(s, "\nHardfile 0: card partition %u", hdf[0].type - HDF_CARDPART(0));
         BootPrint(s);
         sprintf(s, "CHS: %u.%u.%u", hdf[0].cylinders, hdf[0].heads, hdf[0].sectors);
         BootPrint(s);
@@ -346,7 +369,10 @@ void main(void)
     if (OpenHardfile(1))
     {
 
-        sprintf(s, "\nHardfile 1: %.8s.%.3s", hdf[1].file.name, &hdf[1].file.name[8]);
+        if (hdf[1].type == HDF_FILE)
+            sprintf(s, "\nHardfile 1: %.8s.%.3s", hdf[1].file.name, &hdf[1].file.name[8]);
+        else
+            sprintf(s, "\nHardfile 1: card partition %u", hdf[1].type - HDF_CARDPART(0));
         BootPrint(s);
         sprintf(s, "CHS: %u.%u.%u", hdf[1].cylinders, hdf[1].heads, hdf[1].sectors);
         BootPrint(s);
@@ -386,10 +412,9 @@ void main(void)
     ConfigFilter(config.filter.lores, config.filter.hires);
     ConfigScanlines(config.scanlines);
 
+    FpgaRequest_Init();
+
     while (1)
-    {
-        HandleFpga();
-        HandleUI();
-    }
+        HandleTasks();
 
 }
@@ -21,6 +21,17 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 // 2009-11-14   - OSD labels changed
 // 2009-12-15   - added display of directory name extensions
 // 2010-01-09   - support for variable number of tracks
+// 2010-09-12   - card partitions selectable as hardfiles
+// 2010-09-17   - delta overlay menu (create, commit, discard)
+// 2010-09-18   - F9 also dumps IDE trace, F10 starts/stops IDE trace capture (firmware options menu)
+// 2010-09-20   - encoded track cache of the drive is dropped on disk change
+// 2010-09-23   - floppy speed modes: normal, 2x, 4x and max
+// 2010-09-25   - buffered floppy writes are stored before disk eject
+// 2010-09-28   - disk sets: Ctrl+LAlt+F1..F4 changes the disk of the set
+// 2010-09-29   - LZ4 compressed ADF images (ADC) are listed in the floppy file selector
+// 2010-09-30   - extended ADF images are read only
+// 2010-10-02   - HD ADF images are read only
+// 2010-10-06   - long name scrolling ignores FPGA request pulses on INIT_B
 
 #include "AT91SAM7S256.h"
 #include "stdbool.h"
@@ -57,6 +68,10 @@ extern adfTYPE df[4];
 
 extern configTYPE config;
 extern fileTYPE file;
+extern hdfTYPE hdf[2];
+extern hdfTYPE delta_hdf;
+extern unsigned char delta_unit;
+extern unsigned char trace_capture;
 extern char s[40];
 
 extern unsigned char fat32;
@@ -76,8 +91,10 @@ const char *config_filter_msg[] =  {"none", "HOR ", "VER ", "H+V "};
 const char *config_memory_chip_msg[] = {"0.5 MB", "1.0 MB", "1.5 MB", "2.0 MB"};
 const char *config_memory_slow_msg[] = {"none  ", "0.5 MB", "1.0 MB", "1.5 MB"};
 const char *config_scanlines_msg[] = {"off", "dim", "blk"};
+const char *config_floppy_speed_msg[] = {"normal", "2x    ", "4x    ", "max   "};
 
 const char *config_chipset_msg[] = {"OCS-A500", "OCS-A1000", "ECS", "---"};
+const char *config_hardfile_msg[] = {"disabled", "enabled", "card part 1", "card part 2", "card part 3"};
 
 char *config_autofire_msg[] = {"        AUTOFIRE OFF", "        AUTOFIRE FAST", "        AUTOFIRE MEDIUM", "        AUTOFIRE SLOW"};
 
@@ -85,6 +102,8 @@ extern char UploadKickstart(char *name);
 extern unsigned char SaveConfiguration(char *filename);
 
 extern unsigned char DEBUG;
+extern unsigned char floppy_timing;
+extern adfTYPE *diskset_drive;
 
 unsigned char config_autofire = 0;
 
@@ -180,6 +199,20 @@ void HandleUI(void)
             }
         }
         break;
+    case KEY_F1 :
+    case KEY_F2 :
+    case KEY_F3 :
+    case KEY_F4 :
+        if (ctrl && lalt)
+        {
+            if (SwapDiskSet(c - KEY_F1))
+                if (menustate == MENU_NONE2 || menustate == MENU_INFO)
+                {
+                    sprintf(s, "     disk %u: %.22s", c - KEY_F1 + 1, diskset_drive->name);
+                    InfoMessage(s);
+                }
+        }
+        break;
     case KEY_MENU :
         menu = true;
         break;
@@ -288,13 +321,14 @@ void HandleUI(void)
             {
                 if (df[menusub].status & DSK_INSERTED) // eject selected floppy
                 {
+                    FlushTrackBuffer();
                     df[menusub].status = 0;
                     menustate = MENU_MAIN1;
                 }
                 else
                 {
                     df[menusub].status = 0;
-                    SelectFile("ADF", SCAN_DIR | SCAN_LFN, MENU_FILE_SELECTED, MENU_MAIN1);
+                    SelectFile("ADFADC", SCAN_DIR | SCAN_LFN, MENU_FILE_SELECTED, MENU_MAIN1);
                 }
             }
             else if (menusub == 4)
@@ -302,6 +336,7 @@ void HandleUI(void)
         }
         else if (c == KEY_BACK) // eject all floppies
         {
+            FlushTrackBuffer();
             for (i = 0; i <= drives; i++)
                 df[i].status = 0;
 
@@ -574,6 +609,7 @@ void HandleUI(void)
         if (select && menusub == 0)
         {
             menustate = MENU_NONE1;
+            FlushWriteCache();
             OsdReset(RESET_NORMAL);
         }
 
@@ -848,12 +884,14 @@ void HandleUI(void)
         sprintf(s, "         drives : %d", config.floppy.drives + 1);
         OsdWrite(2, s, menusub == 0);
         strcpy(s, "          speed : ");
-        strcat(s, config.floppy.speed ? "fast " : "normal");
+        strcat(s, config_floppy_speed_msg[config.floppy.speed & 0x03]);
+        if (floppy_timing) // normal speed forced by loader
+            strcat(s, " (1x)");
         OsdWrite(3, s, menusub == 1);
         strcpy(s, "       A600 IDE : ");
         strcat(s, config.enable_ide ? "on " : "off");
         OsdWrite(4, s, menusub == 2);
-        sprintf(s, "      hardfiles : %d", (config.hardfile[0].present & config.hardfile[0].enabled) + (config.hardfile[1].present & config.hardfile[1].enabled));
+        sprintf(s, "      hardfiles : %d", (config.hardfile[0].present && config.hardfile[0].enabled) + (config.hardfile[1].present && config.hardfile[1].enabled));
         OsdWrite(5,s, menusub == 3);
         OsdWrite(6, "", 0);
         OsdWrite(7, "              exit", menusub == 4);
@@ -887,7 +925,8 @@ void HandleUI(void)
             else if (menusub == 1)
             {
                 config.floppy.speed++;
-                config.floppy.speed &= 0x01;
+                config.floppy.speed &= 0x03;
+                floppy_timing = 0;
                 menustate = MENU_SETTINGS_DRIVES1;
                 ConfigFloppy(config.floppy.drives, config.floppy.speed);
             }
@@ -895,7 +934,7 @@ void HandleUI(void)
             {
                 config.enable_ide ^= 0x01;
                 menustate = MENU_SETTINGS_DRIVES1;
-                ConfigIDE(config.enable_ide, config.hardfile[0].present & config.hardfile[0].enabled, config.hardfile[1].present & config.hardfile[1].enabled);
+                ConfigIDE(config.enable_ide, config.hardfile[0].present && config.hardfile[0].enabled, config.hardfile[1].present && config.hardfile[1].enabled);
             }
             else if (menusub == 3)
             {
@@ -937,9 +976,11 @@ void HandleUI(void)
         OsdWrite(0, "            HARDFILES", 0);
         OsdWrite(1, "", 0);
         strcpy(s, "     Master : ");
-        strcat(s, config.hardfile[0].present ? config.hardfile[0].enabled ? "enabled" : "disabled" : "n/a");
+        strcat(s, config.hardfile[0].present || config.hardfile[0].enabled > HDF_FILE ? config_hardfile_msg[config.hardfile[0].enabled] : "n/a");
         OsdWrite(2, s, menusub == 0);
-        if (config.hardfile[0].present)
+        if (config.hardfile[0].enabled > HDF_FILE)
+            OsdWrite(3, "", menusub == 1);
+        else if (config.hardfile[0].present)
         {
             strcpy(s, "                                ");
             if (config.hardfile[0].long_name[0])
@@ -952,9 +993,11 @@ void HandleUI(void)
             OsdWrite(3, "       ** file not found **", menusub == 1);
 
         strcpy(s, "      Slave : ");
-        strcat(s, config.hardfile[1].present ? config.hardfile[1].enabled ? "enabled" : "disabled" : "n/a");
+        strcat(s, config.hardfile[1].present || config.hardfile[1].enabled > HDF_FILE ? config_hardfile_msg[config.hardfile[1].enabled] : "n/a");
         OsdWrite(4, s, menusub == 2);
-        if (config.hardfile[1].present)
+        if (config.hardfile[1].enabled > HDF_FILE)
+            OsdWrite(5, "", menusub == 3);
+        else if (config.hardfile[1].present)
         {
             strcpy(s, "                                ");
             if (config.hardfile[1].long_name[0])
@@ -966,15 +1009,17 @@ void HandleUI(void)
         else
             OsdWrite(5, "       ** file not found **", menusub == 3);
 
-        OsdWrite(6, "", 0);
-        OsdWrite(7, "              exit", menusub == 4);
+        strcpy(s, "      Delta : ");
+        strcat(s, delta_unit == 0 ? "master" : delta_unit == 1 ? "slave" : "none");
+        OsdWrite(6, s, menusub == 4);
+        OsdWrite(7, "              exit", menusub == 5);
 
         menustate = MENU_SETTINGS_HARDFILE2;
         break;
 
     case MENU_SETTINGS_HARDFILE2 :
 
-        if (down && menusub < 4)
+        if (down && menusub < 5)
         {
             menusub++;
             menustate = MENU_SETTINGS_HARDFILE1;
@@ -990,11 +1035,11 @@ void HandleUI(void)
         {
             if (menusub == 0)
             {
-                if (config.hardfile[0].present)
-                {
-                   config.hardfile[0].enabled ^= 0x01;
-                   menustate = MENU_SETTINGS_HARDFILE1;
-                }
+                if (config.hardfile[0].enabled < HDF_CARDPART_MAX) // cycle through file and card partitions
+                    config.hardfile[0].enabled++;
+                else
+                    config.hardfile[0].enabled = HDF_DISABLED;
+                menustate = MENU_SETTINGS_HARDFILE1;
             }
             else if (menusub == 1)
             {
@@ -1002,17 +1047,22 @@ void HandleUI(void)
             }
             else if (menusub == 2)
             {
-                if (config.hardfile[1].present)
-                {
-                   config.hardfile[1].enabled ^= 0x01;
-                   menustate = MENU_SETTINGS_HARDFILE1;
-                }
+                if (config.hardfile[1].enabled < HDF_CARDPART_MAX) // cycle through file and card partitions
+                    config.hardfile[1].enabled++;
+                else
+                    config.hardfile[1].enabled = HDF_DISABLED;
+                menustate = MENU_SETTINGS_HARDFILE1;
             }
             else if (menusub == 3)
             {
                 SelectFile("HDF", SCAN_LFN, MENU_HARDFILE_SELECTED, MENU_SETTINGS_HARDFILE1);
             }
-            else if (menusub == 4) // return to previous menu
+            else if (menusub == 4)
+            {
+                menustate = MENU_HARDFILE_DELTA1;
+                menusub = 0;
+            }
+            else if (menusub == 5) // return to previous menu
             {
                 menustate = MENU_HARDFILE_EXIT;
             }
@@ -1024,6 +1074,84 @@ void HandleUI(void)
         }
         break;
 
+        /******************************************************************/
+        /* delta overlay menu                                             */
+        /******************************************************************/
+    case MENU_HARDFILE_DELTA1 :
+
+        OsdWrite(0, "          DELTA OVERLAY", 0);
+        OsdWrite(1, "", 0);
+        if (delta_unit == HDF_NO_DELTA)
+        {
+            OsdWrite(2, "   writes go to the hardfiles", 0);
+            OsdWrite(3, "", 0);
+            OsdWrite(4, "        create for master", menusub == 0);
+            OsdWrite(5, "        create for slave", menusub == 1);
+        }
+        else
+        {
+            sprintf(s, "   %s: %lu KB changed", delta_unit ? "slave" : "master", delta_hdf.blocks << (HDF_DELTA_BLOCK_SHIFT - 1));
+            OsdWrite(2, s, 0);
+            OsdWrite(3, "", 0);
+            OsdWrite(4, "          commit changes", menusub == 0);
+            OsdWrite(5, "         discard changes", menusub == 1);
+        }
+        OsdWrite(6, "", 0);
+        OsdWrite(7, "              exit", menusub == 2);
+
+        menustate = MENU_HARDFILE_DELTA2;
+        break;
+
+    case MENU_HARDFILE_DELTA2 :
+
+        if (down && menusub < 2)
+        {
+            menusub++;
+            menustate = MENU_HARDFILE_DELTA1;
+        }
+
+        if (up && menusub > 0)
+        {
+            menusub--;
+            menustate = MENU_HARDFILE_DELTA1;
+        }
+
+        if (select) // failures are reported on the serial port, the status line shows the resulting state
+        {
+            if (menusub < 2 && delta_unit == HDF_NO_DELTA) // base image stays unchanged from now on
+            {
+                CreateDelta(menusub);
+                menustate = MENU_HARDFILE_DELTA1;
+            }
+            else if (menusub == 0) // changes become part of the base image
+            {
+                CommitDelta();
+                menustate = MENU_HARDFILE_DELTA1;
+            }
+            else if (menusub == 1) // the disk returns to the state of the base image
+            {
+                if (DiscardDelta())
+                {
+                    OsdReset(RESET_NORMAL);
+                    menustate = MENU_NONE1;
+                }
+                else
+                    menustate = MENU_HARDFILE_DELTA1;
+            }
+            else // return to previous menu
+            {
+                menustate = MENU_SETTINGS_HARDFILE1;
+                menusub = 4;
+            }
+        }
+
+        if (menu)
+        {
+            menustate = MENU_SETTINGS_HARDFILE1;
+            menusub = 4;
+        }
+        break;
+
         /******************************************************************/
         /* hardfile selected menu                                         */
         /******************************************************************/
@@ -1034,6 +1162,8 @@ void HandleUI(void)
             memcpy((void*)config.hardfile[0].name, (void*)file.name, sizeof(config.hardfile[0].name));
             memcpy((void*)config.hardfile[0].long_name, (void*)file.long_name, sizeof(config.hardfile[0].long_name));
             config.hardfile[0].present = 1;
+            if (config.hardfile[0].enabled > HDF_FILE) // selecting a file leaves card partition mode
+                config.hardfile[0].enabled = HDF_FILE;
         }
 
         if (menusub == 3) // slave drive selected
@@ -1041,6 +1171,8 @@ void HandleUI(void)
             memcpy((void*)config.hardfile[1].name, (void*)file.name, sizeof(config.hardfile[1].name));
             memcpy((void*)config.hardfile[1].long_name, (void*)file.long_name, sizeof(config.hardfile[1].long_name));
             config.hardfile[1].present = 1;
+            if (config.hardfile[1].enabled > HDF_FILE) // selecting a file leaves card partition mode
+                config.hardfile[1].enabled = HDF_FILE;
         }
 
         menustate = MENU_SETTINGS_HARDFILE1;
@@ -1095,13 +1227,14 @@ void HandleUI(void)
         {
             if (menusub == 0) // yes
             {
-                if (strncmp(config.hardfile[0].name, t_hardfile[0].name, sizeof(t_hardfile[0].name)) != 0)
+                if (strncmp(config.hardfile[0].name, t_hardfile[0].name, sizeof(t_hardfile[0].name)) != 0 || config.hardfile[0].enabled != t_hardfile[0].enabled)
                     OpenHardfile(0);
 
-                if (strncmp(config.hardfile[1].name, t_hardfile[1].name, sizeof(t_hardfile[1].name)) != 0)
+                if (strncmp(config.hardfile[1].name, t_hardfile[1].name, sizeof(t_hardfile[1].name)) != 0 || config.hardfile[1].enabled != t_hardfile[1].enabled)
                     OpenHardfile(1);
 
-                ConfigIDE(config.enable_ide, config.hardfile[0].present & config.hardfile[0].enabled, config.hardfile[1].present & config.hardfile[1].enabled);
+                ConfigIDE(config.enable_ide, config.hardfile[0].present && config.hardfile[0].enabled, config.hardfile[1].present && config.hardfile[1].enabled);
+                FlushWriteCache();
                 OsdReset(RESET_NORMAL);
 
                 menustate = MENU_NONE1;
@@ -1251,6 +1384,7 @@ void HandleUI(void)
                 memcpy((void*)config.kickstart.long_name, (void*)file.long_name, sizeof(config.kickstart.long_name));
 
                 OsdDisable();
+                FlushWriteCache();
                 OsdReset(RESET_BOOTLOADER);
                 ConfigChipset(config.chipset | CONFIG_TURBO);
                 ConfigFloppy(config.floppy.drives, CONFIG_FLOPPY2X);
@@ -1465,6 +1599,18 @@ void HandleUI(void)
                 printf("DEBUG ON\r");
             }
         }
+        else if (c == KEY_F9)
+        {
+            PrintHardfileStatistics();
+            PrintTrace();
+        }
+        else if (c == KEY_F10) // IDE trace capture to the card on/off
+        {
+            if (trace_capture)
+                StopTraceCapture();
+            else
+                StartTraceCapture();
+        }
         else if (menu)
         {
             menusub = 1;
@@ -1616,7 +1762,7 @@ void ScrollLongName(void)
     static unsigned long pioa_old;
     unsigned long pioa;
 
-    pioa = *AT91C_PIOA_PDSR;
+    pioa = GetVsync(); // INIT_B also pulses on FPGA requests
 
     if (DirEntryLFN[k][0] && CheckTimer(scroll_timer)) // scroll if long name and timer delay elapsed
     if ((pioa ^ pioa_old) & INIT_B)
@@ -1826,25 +1972,8 @@ void _strncpy(char* pStr1, const char* pStr2, size_t nCount)
 // insert floppy image pointed to to by global <file> into <drive>
 void InsertFloppy(adfTYPE *drive)
 {
-    unsigned char i, j;
-    unsigned long tracks;
-
-    // calculate number of tracks in the ADF image file
-    tracks = file.size / (512*11);
-    if (tracks > MAX_TRACKS)
-    {
-        printf("UNSUPPORTED ADF SIZE!!! Too many tracks: %lu\r", tracks);
-        tracks = MAX_TRACKS;
-    }
-    drive->tracks = (unsigned char)tracks;
-
-    // fill index cache
-    for (i = 0; i < tracks; i++) // for every track get its start position within image file
-    {
-        drive->cache[i] = file.cluster; // start of the track within image file
-        for (j = 0; j < 11; j++)
-            FileNextSector(&file); // advance by track length (11 sectors)
-    }
+    // calculate number of tracks in the ADF image file and prepare index cache
+    BuildTrackIndex(drive, &file);
 
     // copy image file name into drive struct
     if (file.long_name[0]) // file has long name
@@ -1861,15 +1990,18 @@ void InsertFloppy(adfTYPE *drive)
         strncpy(&drive->name[17], DiskInfo, sizeof(DiskInfo)); // copy disk number info
     }
 
+    InvalidateTrackCache(drive);
+    RestoreFloppySpeed(); // new disk, new loader
+
     // initialize the rest of drive struct
     drive->status = DSK_INSERTED;
-    if (!(file.attributes & ATTR_READONLY)) // read-only attribute
+    if (!(file.attributes & ATTR_READONLY) && drive->format == ADF_STANDARD && drive->sectors == DD_SECTORS) // read-only attribute, compressed, extended and HD images are read only
         drive->status |= DSK_WRITABLE;
 
-    drive->cluster_offset = drive->cache[0];
-    drive->sector_offset = 0;
+    drive->track_offset = 0;
     drive->track = 0;
     drive->track_prev = -1;
+    drive->step = 1;
 
     // some debug info
     if (file.long_name[0])
@@ -1881,6 +2013,8 @@ void InsertFloppy(adfTYPE *drive)
     printf("file size: %lu (%lu KB)\r", file.size, file.size >> 10);
     printf("drive tracks: %u\r", drive->tracks);
     printf("drive status: 0x%02X\r", drive->status);
+
+    ScanDiskSet(drive, &file); // other disks of the set
 }
 
 /*  Error Message */
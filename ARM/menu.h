@@ -33,6 +33,8 @@ enum MENU
     MENU_HARDFILE_EXIT,
     MENU_HARDFILE_CHANGED1,
     MENU_HARDFILE_CHANGED2,
+    MENU_HARDFILE_DELTA1,
+    MENU_HARDFILE_DELTA2,
     MENU_MAIN2_1,
     MENU_MAIN2_2,
     MENU_FIRMWARE1,
@@ -0,0 +1,130 @@
+/*
+Copyright 2010 Jakub Bednarski
+
+This file is part of Minimig
+
+Minimig is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+(at your option) any later version.
+
+Minimig is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// 2010-09-19   - cooperative scheduler with task priorities
+// 2010-09-25   - delayed floppy writes in background
+//
+// Every pass of the main loop serves pending FPGA requests (floppy before IDE), then background work and the user interface.
+// Long operations (directory scans, firmware CRC check, hardfile index build, multi-sector IDE transfers)
+// call Yield() between their steps so requests of higher priority tasks are served without waiting for them to finish.
+// Yield() is only called where the caller's state doesn't depend on sector_buffer contents or an open SPI transfer.
+
+#include "AT91SAM7S256.h"
+#include "stdio.h"
+#include "hardware.h"
+#include "FAT.h"
+#include "FDD.h"
+#include "HDD.h"
+#include "menu.h"
+#include "tasks.h"
+
+extern unsigned char fpga_request;
+
+unsigned char task_running = 0; // task being executed (0 until the main loop is started)
+unsigned char fpga_pending = 1; // requests found in the last FPGA status read
+
+unsigned char HandleFpga(unsigned char tasks)
+{
+    // reads FPGA status and serves the requests of the given tasks
+    // returns request bits of the status word
+    unsigned char c1, c2;
+    unsigned char running;
+
+    EnableFpga();
+    c1 = SPI(0); // cmd request and drive number
+    c2 = SPI(0); // track number
+    SPI(0);
+    SPI(0);
+    SPI(0);
+    SPI(0);
+    DisableFpga();
+
+    running = task_running;
+
+    if (tasks & TASK_FDD)
+    {
+        task_running = TASK_FDD;
+        HandleFDD(c1, c2);
+    }
+    else
+        HandleFDD(c1 & ~(CMD_RDTRK | CMD_WRTRK), c2); // only updates number of drives
+
+    if (tasks & TASK_IDE)
+    {
+        task_running = TASK_IDE;
+        HandleHDD(c1, c2);
+    }
+
+    task_running = running;
+
+    UpdateDriveStatus();
+
+    return(c1 & (CMD_RDTRK | CMD_WRTRK | CMD_IDECMD));
+}
+
+void Yield(unsigned char tasks)
+{
+    // serves pending requests of the given tasks if they have higher priority than the running one
+    unsigned char mask;
+    unsigned char status;
+
+    if (!task_running)
+        return;
+
+    tasks &= (task_running - 1) & (TASK_FDD | TASK_IDE);
+    if (!tasks)
+        return;
+
+    if (!CheckFpgaRequest()) // no new request nor vertical sync since last check
+        return;
+
+    mask = 0;
+    if (tasks & TASK_FDD)
+        mask |= CMD_RDTRK | CMD_WRTRK;
+    if (tasks & TASK_IDE)
+        mask |= CMD_IDECMD;
+
+    do
+        status = HandleFpga(tasks);
+    while (status & mask);
+
+    if (status)
+        fpga_request = 1; // requests of other tasks are left for the main loop
+}
+
+void HandleTasks(void)
+{
+    // one pass of the main loop, the processor idles till the next INIT_B change if there is no pending request
+
+    if (CheckFpgaRequest()) // new request or vertical sync
+        fpga_pending = 1;
+
+    if (fpga_pending) // a served request may be followed by another one without INIT_B change
+        fpga_pending = HandleFpga(TASK_FDD | TASK_IDE);
+
+    task_running = TASK_BACKGROUND;
+    HandleFDDBackground();
+    HandleHDDBackground();
+
+    task_running = TASK_UI;
+    HandleUI();
+
+    if (!fpga_pending)
+        WaitFpgaRequest();
+}
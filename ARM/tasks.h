@@ -0,0 +1,9 @@
+// cooperative scheduler tasks, lower bit has higher priority
+#define TASK_FDD        0x01 // floppy track read/write requests
+#define TASK_IDE        0x02 // IDE command requests
+#define TASK_BACKGROUND 0x04 // write-back buffer flush, trace capture
+#define TASK_UI         0x08 // keyboard and OSD menu
+
+unsigned char HandleFpga(unsigned char tasks);
+void Yield(unsigned char tasks);
+void HandleTasks(void);
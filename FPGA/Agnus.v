@@ -145,6 +145,7 @@
 // 2009-12-27	- OCS Denise compatible display window generation
 // 2010-04-13	- undocumented 7 bitplane mode implemented
 // 2010-06-29	- added more magic to ddf logic
+// 2010-09-23	- floppy speed modes: normal, 2x, 4x and maximum
 
 //SB:
 // 2011-03-08	- added DIP and FatAgnus handling of scanline 0 (fix for RoboCop2 game)
@@ -185,7 +186,7 @@ module Agnus
 	input	ntsc,						// chip is NTSC
 	input	a1k,						// enable A1000 OCS features
 	input	ecs,						// enable ECS features
-	input	floppy_speed,				// allocates refresh slots for disk DMA
+	input	[1:0] floppy_speed,			// allocates extra slots for disk DMA (0 - normal, 1 - 2x, 2 - 4x, 3 - max)
 	input	turbo						// alows blitter to take extra DMA slots 
 );
 
@@ -1212,7 +1213,7 @@ module dskdma_engine
 	output	dma,					//true if disk dma engine uses it's cycle
 	input	dmal,					//Paula requests dma
 	input	dmas,					//Paula special dma
-	input	speed,
+	input	[1:0] speed,			//0 - normal, 1 - 2x, 2 - 4x, 3 - maximum
 	input	turbo,
 	input	[8:0] hpos,				//horizontal beam counter (advanced by 4 CCKs)
 	output	wr,						//write (disk dma writes to memory)
@@ -1230,27 +1231,35 @@ parameter DSKDATR = 9'h008;
 //local signals
 wire	[20:1] address_outnew;	//new disk dma pointer
 reg		dmaslot;				//indicates if the current slot can be used to transfer data
+wire	cpuslot;				//CPU slot used in 4x mode
+wire	maxspeed;				//every CPU slot is used
 
 //--------------------------------------------------------------------------------------
 
 //dma cycle allocation
 //nominally disk DMA uses 3 slots: 08, 0A and 0C
-//refresh slots: 00, 02, 04 and 06 are used for higher transfer speed
+//refresh slots: 00, 02, 04 and 06 are used for higher transfer speed (2x)
+//4x mode takes also the CPU slots between them (14 slots per line)
+//maximum speed mode (or any fast mode with turbo CPU) takes every CPU slot
 //hint: Agnus hpos counter is advanced by 4 CCK cycles
 always @(hpos or speed)
 	case (hpos[8:1])
-		8'h04:		dmaslot = speed;
-		8'h06:		dmaslot = speed;
-		8'h08:		dmaslot = speed;
-		8'h0A:		dmaslot = speed;
+		8'h04:		dmaslot = |speed;
+		8'h06:		dmaslot = |speed;
+		8'h08:		dmaslot = |speed;
+		8'h0A:		dmaslot = |speed;
 		8'h0C:		dmaslot = 1;
 		8'h0E:		dmaslot = 1;
 		8'h10:		dmaslot = 1;
 		default: 	dmaslot = 0;
 	endcase
 
+assign cpuslot = speed==2'b10 && hpos[8:1]>=8'h04 && hpos[8:1]<=8'h10 ? 1'b1 : 1'b0;
+
+assign maxspeed = speed==2'b11 || turbo && |speed ? 1'b1 : 1'b0;
+
 //dma request
-assign dma = dmal & (dmaslot & ~(turbo & speed) & hpos[0] | turbo & speed & ~hpos[0]);
+assign dma = dmal & (dmaslot & ~maxspeed & hpos[0] | (cpuslot | maxspeed) & ~hpos[0]);
 
 //write signal
 assign wr = ~dmas;
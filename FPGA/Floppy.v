@@ -63,6 +63,11 @@
 // 2009-12-26	- step enable
 // 2010-04-12	- implemented work-around for dsksync interrupt request
 // 2010-08-14	- set BYTEREADY of DSKBYTR (required by Kick Off 2 loader)
+// 2010-09-18	- request pulse for the MCU (new floppy or hdd request)
+// 2010-09-22	- fifo level is sent in the 4th status word during track read (MCU sends bursts of sectors)
+// 2010-10-02	- HD disks: HD drive ID (0xAAAAAAAA) and 150 RPM index pulses for drives with HD disk inserted
+// 2010-10-04	- floppy data can be sent directly from the SD card (ROM upload)
+// 2010-10-06	- reset counter is sent in the 3rd status word of IDE register reads
 
 module floppy
 (
@@ -111,7 +116,8 @@ module floppy
 	output	hdd_wr,					// task file register write strobe
 	output	hdd_status_wr,			// status register write strobe (MCU->HDD)
 	output	hdd_data_wr,			// data write strobe
-	output	hdd_data_rd				// data read strobe
+	output	hdd_data_rd,			// data read strobe
+	output	mcu_req					// request pulse for the MCU
 );
 
 //register names and addresses
@@ -151,10 +157,11 @@ module floppy
 	// JB:
 	wire	fifo_reset;
 	reg		dmaen;					//dsklen dma enable
-	reg		[15:0] wr_fifo_status;
+	reg		[15:0] fifo_status;
 
 	reg		[3:0] disk_present;		//disk present status
 	reg		[3:0] disk_writable;	//disk write access status
+	reg		[3:0] disk_hd;			//HD disk inserted (drive identifies itself as HD drive)
 
 	wire	_selx;					//active whenever any drive is selected
 	wire	[1:0] sel;				//selected drive number
@@ -168,6 +175,7 @@ module floppy
 	// drive motor control
 	reg		[3:0] _sel_del;			// deleyed drive select signals for edge detection
 	reg		[3:0] motor_on;			// drive motor on
+	reg		[3:0] id_bit;			// current bit of HD drive ID
 
 	//decoded SPI commands
 	reg		cmd_fdd;				//SPI host accesses floppy drive buffer
@@ -305,7 +313,7 @@ always @(posedge clk)
 //HDD interface
 assign hdd_addr = cmd_hdd_rd ? tx_data_cnt : cmd_hdd_wr ? rx_data_cnt : 0;
 assign hdd_wr = cmd_hdd_wr && rx_flag && rx_cnt==3 ? 1 : 0;
-assign hdd_data_wr = (cmd_hdd_data_wr && rx_flag && rx_cnt==3) || (scs2 && rx_flag) ? 1 : 0;	//there is a possibility that SCS2 is inactive before rx_flag is generated, depends on how fast the CS2 is deaserted after sending the last data bit
+assign hdd_data_wr = (cmd_hdd_data_wr && rx_flag && rx_cnt==3) || (scs2 && rx_flag && !cmd_fdd) ? 1 : 0;	//there is a possibility that SCS2 is inactive before rx_flag is generated, depends on how fast the CS2 is deaserted after sending the last data bit
 assign hdd_status_wr = rx_data[15:12]==4'b1111 && rx_flag && rx_cnt==0 ? 1 : 0;
 // problem: spi_cmd1 doesn't deactivate after rising _CS line: direct transfers will be treated as command words,
 // workaround: always send more than one command word
@@ -329,7 +337,8 @@ always @(posedge clk)
 	rx_cnt <= spi_rx_cnt;
 
 //spidat strobe
-assign spidat = cmd_fdd && rx_flag && rx_cnt==3 ? 1 : 0;
+//direct transfers from the SD card follow the floppy command words sent by the MCU (the word counter doesn't change then)
+assign spidat = cmd_fdd && rx_flag && (rx_cnt==3 || scs2) ? 1 : 0;
 
 //------------------------------------
 
@@ -354,24 +363,56 @@ always @(spi_tx_cnt or spi_tx_data_0 or spi_tx_data_1 or spi_tx_data_2 or spi_tx
 always @(sel or drives or hdd_dat_req or hdd_cmd_req or trackwr or trackrd or track or fifo_cnt)
 	spi_tx_data_0 = {sel[1:0],drives[1:0],hdd_dat_req,hdd_cmd_req,trackwr,trackrd&~fifo_cnt[10],track[7:0]};
 
+//request pulse for the MCU
+//any new request (rising edge of a request bit of the status word) generates a 1us pulse,
+//the MCU is woken up by it instead of polling the status word over SPI
+reg		[3:0] mcu_req_del;		//delayed request bits for edge detection
+reg		[2:0] mcu_req_cnt;		//request pulse length counter
+
+always @(posedge clk)
+	mcu_req_del <= {hdd_dat_req,hdd_cmd_req,trackwr,trackrd&~fifo_cnt[10]};
+
+always @(posedge clk)
+	if (reset)
+		mcu_req_cnt <= 0;
+	else if ({hdd_dat_req,hdd_cmd_req,trackwr,trackrd&~fifo_cnt[10]} & ~mcu_req_del)
+		mcu_req_cnt <= 3'd7;
+	else if (mcu_req_cnt != 0)
+		mcu_req_cnt <= mcu_req_cnt - 3'd1;
+
+assign mcu_req = mcu_req_cnt != 0 ? 1'b1 : 1'b0;
+
 always @(dsksync)
 	if (reset)
 		spi_tx_data_1 = 0;
 	else
 		spi_tx_data_1 = dsksync[15:0];
 
-always @(trackrd or dmaen or dsklen or trackwr or wr_fifo_status)
-	if (trackrd)
+//reset counter, the MCU flushes its hdd write cache when it sees a new value
+reg		reset_del;
+reg		[3:0] reset_cnt = 4'd0;
+
+always @(posedge clk)
+	reset_del <= reset;
+
+always @(posedge clk)
+	if (reset && !reset_del)
+		reset_cnt <= reset_cnt + 4'd1;
+
+always @(cmd_hdd_rd or reset_cnt or trackrd or dmaen or dsklen or trackwr or fifo_status)
+	if (cmd_hdd_rd)
+		spi_tx_data_2 = {12'h000,reset_cnt};
+	else if (trackrd)
 		spi_tx_data_2 = {dmaen,dsklen[14:0]};
 	else if (trackwr)
-		spi_tx_data_2 = wr_fifo_status;
+		spi_tx_data_2 = fifo_status;
 	else
 		spi_tx_data_2 = 0;
 
-always @(cmd_fdd or trackrd or dmaen or dsklen or trackwr or fifo_out or cmd_hdd_rd or cmd_hdd_data_rd or hdd_data_in)	
+always @(cmd_fdd or trackrd or fifo_status or trackwr or fifo_out or cmd_hdd_rd or cmd_hdd_data_rd or hdd_data_in)	
 	if (cmd_fdd)
 		if (trackrd)
-			spi_tx_data_3 = {dmaen,dsklen[14:0]};
+			spi_tx_data_3 = fifo_status;
 		else if (trackwr)
 			spi_tx_data_3 = fifo_out;
 		else
@@ -382,11 +423,12 @@ always @(cmd_fdd or trackrd or dmaen or dsklen or trackwr or fifo_out or cmd_hdd
 		spi_tx_data_3 = 0;
 
 
-//floppy disk write fifo status is latched when transmision of the previous spi word begins 
+//floppy disk fifo status is latched when transmision of the previous spi word begins 
 //it guarantees that when latching the status data into spi transmit register setup and hold times are met
+//during track read the MCU uses the fifo level to size its data bursts
 always @(posedge clk)
 	if (tx_flag)
-		wr_fifo_status <= {dmaen&dsklen[14],3'b000,fifo_cnt[11:0]};
+		fifo_status <= {dmaen&dsklen[14],3'b000,fifo_cnt[11:0]};
 
 //-----------------------------------------------------------------------------------------------//
 //active floppy drive number, updated during reset
@@ -404,8 +446,14 @@ always @(posedge clk)
 		else
 			rpm_pulse_cnt <= rpm_pulse_cnt + 1;
 
+// HD disks spin at 150 RPM (twice as much data per revolution at the same data rate)
+reg rpm_half;
+always @(posedge clk)
+	if (sof && rpm_pulse_cnt==0)
+		rpm_half <= ~rpm_half;
+
 // disk index pulses output
-assign index = |(~_sel & motor_on) & ~|rpm_pulse_cnt & sof;
+assign index = |(~_sel & motor_on & (~disk_hd | {4{rpm_half}})) & ~|rpm_pulse_cnt & sof;
 
 //--------------------------------------------------------------------------------------
 //data out multiplexer
@@ -465,6 +513,37 @@ always @(posedge clk)
 	else if (!_sel[3] && _sel_del[3])
 		motor_on[3] <= ~_motor;
 
+// HD drive identification
+// the ID is shifted out on _ready line (active _ready is a one bit) at every drive selection while the motor is off,
+// switching the motor off resets the shift register, HD drive ID is 0xAAAAAAAA (DD drive ID 0xFFFFFFFF)
+always @(posedge clk)
+	if (reset)
+		id_bit[0] <= 1'b0;
+	else if (!_sel[0] && _sel_del[0])
+		id_bit[0] <= motor_on[0] ? 1'b0 : ~id_bit[0];
+
+always @(posedge clk)
+	if (reset)
+		id_bit[1] <= 1'b0;
+	else if (!_sel[1] && _sel_del[1])
+		id_bit[1] <= motor_on[1] ? 1'b0 : ~id_bit[1];
+
+always @(posedge clk)
+	if (reset)
+		id_bit[2] <= 1'b0;
+	else if (!_sel[2] && _sel_del[2])
+		id_bit[2] <= motor_on[2] ? 1'b0 : ~id_bit[2];
+
+always @(posedge clk)
+	if (reset)
+		id_bit[3] <= 1'b0;
+	else if (!_sel[3] && _sel_del[3])
+		id_bit[3] <= motor_on[3] ? 1'b0 : ~id_bit[3];
+
+// drives with HD disk don't activate _ready for zero bits of the ID
+wire	[3:0] _id;
+assign _id = disk_hd & ~motor_on & ~id_bit;
+
 //_ready,_track0 and _change signals
 assign _change = &(_sel | _disk_change);
 
@@ -492,10 +571,10 @@ assign dsktrack79 = dsktrack[sel]==82 ? 1 : 0;
 // Amiga DD drive activates _ready whenever _sel is active and motor is off
 // or whenever _sel is active, motor is on and there is a disk inserted (not implemented - _ready is active when _sel is active)
 
-assign _ready 	= (_sel[3] | ~(drives[1] & drives[0])) 
-				& (_sel[2] | ~drives[1]) 
-				& (_sel[1] | ~(drives[1] | drives[0])) 
-				& (_sel[0]);
+assign _ready 	= (_sel[3] | ~(drives[1] & drives[0]) | _id[3]) 
+				& (_sel[2] | ~drives[1] | _id[2]) 
+				& (_sel[1] | ~(drives[1] | drives[0]) | _id[1]) 
+				& (_sel[0] | _id[0]);
 
 //--------------------------------------------------------------------------------------
 
@@ -613,12 +692,12 @@ parameter DISKDMA_IDLE   = 2'b00;
 parameter DISKDMA_ACTIVE = 2'b10;
 parameter DISKDMA_INT    = 2'b11;
 
-//disk present and write protect status
+//disk present, write protect and HD disk status
 always @(posedge clk)
 	if(reset)
-		{disk_writable[3:0],disk_present[3:0]} <= 8'b0000_0000;
+		{disk_hd[3:0],disk_writable[3:0],disk_present[3:0]} <= 12'b0000_0000_0000;
 	else if (rx_data[15:12]==4'b0001 && rx_flag && rx_cnt==0)
-		{disk_writable[3:0],disk_present[3:0]} <= rx_data[7:0];
+		{disk_hd[3:0],disk_writable[3:0],disk_present[3:0]} <= rx_data[11:0];
 
 always @(posedge clk)
 	if (reset)
@@ -128,6 +128,8 @@
 // 2010-07-28	- added vsync for the MCU
 // 2010-08-05	- added cache for the CPU
 // 2010-08-15	- added joystick emulation
+// 2010-09-18	- floppy/hdd request pulse for the MCU on init_b
+// 2010-09-23	- 2-bit floppy speed (normal, 2x, 4x, max)
 //
 // SB:
 // 2010-12-22	- better drive step sound at 31KHz mode
@@ -219,7 +221,7 @@ module Minimig1
 	// user i/o
 	output	drv_snd,
 	// unused pins
-	output	init_b				// vertical sync for MCU (sync OSD update)
+	output	init_b				// vertical sync and request pulse for MCU
 );
 
 //--------------------------------------------------------------------------------------
@@ -375,6 +377,7 @@ wire	hdd_wr;					// register write strobe
 wire	hdd_status_wr;			// status register write strobe
 wire	hdd_data_wr;			// data port write strobe
 wire	hdd_data_rd;			// data port read strobe
+wire	mcu_req;				// floppy/hdd request pulse for the MCU
 
 wire	[7:0] bank;				// memory bank select
 
@@ -427,6 +430,8 @@ always @(posedge clk)
 		ntsc <= (chipset_config[1]);
 
 // vertical sync for the MCU
+// every vertical sync toggles init_b, floppy and hdd requests invert it for 1us
+// (both are level changes seen by the MCU's PIO input change detection)
 reg vsync_del = 1'b0; 	// delayed vsync signal for edge detection
 reg	vsync_t = 1'b0;		// toggled vsync output
 
@@ -437,7 +442,7 @@ always @(posedge clk)
 	if (~_vsync_i && vsync_del)
 		vsync_t <= (~vsync_t);
 
-assign init_b = (vsync_t);
+assign init_b = (vsync_t ^ mcu_req);
 
 //--------------------------------------------------------------------------------------
 
@@ -478,7 +483,7 @@ Agnus AGNUS1
 	.ntsc(ntsc),
 	.a1k(chipset_config[2]),
 	.ecs(chipset_config[3]),
-	.floppy_speed(floppy_config[0]),
+	.floppy_speed(floppy_config[1:0]),
 	.turbo(turbo)
 );
 
@@ -536,7 +541,8 @@ Paula PAULA1
 	.hdd_wr(hdd_wr),
 	.hdd_status_wr(hdd_status_wr),
 	.hdd_data_wr(hdd_data_wr),
-	.hdd_data_rd(hdd_data_rd)
+	.hdd_data_rd(hdd_data_rd),
+	.mcu_req(mcu_req)
 );
 
 // instantiate user IO
@@ -52,6 +52,7 @@
 // 2009-05-24	- clean-up & renaming
 // 2009-07-10	- implementation of intreq[14] (Unreal needs it)
 // 2009-11-14	- added 28 MHz clock input for sigma-delta modulator
+// 2010-09-18	- request pulse for the MCU
 //
 // AMR:
 // 2013-03-12   - added 9th bit in serial data transfer used by a few games
@@ -119,7 +120,9 @@ module Paula
 	output	hdd_wr,					// task file write enable
 	output	hdd_status_wr,			// drive status write enable
 	output	hdd_data_wr,			// data port write enable
-	output	hdd_data_rd				// data port read enable
+	output	hdd_data_rd,			// data port read enable
+	// MCU request
+	output	mcu_req					// floppy/hdd request pulse for the MCU
 );
 //--------------------------------------------------------------------------------------
 
@@ -276,7 +279,8 @@ floppy pf1
 	.hdd_wr(hdd_wr),
 	.hdd_status_wr(hdd_status_wr),
 	.hdd_data_wr(hdd_data_wr),
-	.hdd_data_rd(hdd_data_rd)
+	.hdd_data_rd(hdd_data_rd),
+	.mcu_req(mcu_req)
 );
 
 //instantiate audio controller
@@ -38,6 +38,8 @@ ADF Routines for minimig
 			- Removed Flopy insert on OSD, not visible anyway
 2010-09-09	- Added definitions for standard floppy size
 			- Added defines for MFM format
+2010-09-21	- Data checksum in SectorToFpga folded to one XOR per byte
+2010-10-01	- Added track maps, track start clusters are found on first access and kept for recently used floppies
 			
 */
 
@@ -60,6 +62,12 @@ unsigned char Error;
 struct adfTYPE *pdfx;						// drive select pointer
 struct adfTYPE df[MAX_FLOPPY_DRIVES];	// drives information structure
 
+// Track maps of recently used floppies
+struct trackMapTYPE trackMap[TRACK_MAPS];
+
+// Index of cluster holding the first sector of track in cluster run
+#define	TRACK_CLUSTER(track)	(((unsigned long)(track) * SECTOR_COUNT) / selectedPartiton.clusterSize)
+
 
 
 void HandleFDD(unsigned char c1, unsigned char c2)
@@ -125,6 +133,7 @@ void InsertFloppy(struct adfTYPE *drive)
 	{	drive->status |= DSK_WRITABLE;		}
 
 	drive->firstCluster = file.firstCluster;
+	AssignTrackMap(drive);
 	drive->clusteroffset=drive->firstCluster;
 	drive->sectoroffset=0;
 	drive->track=0;
@@ -138,6 +147,104 @@ void InsertFloppy(struct adfTYPE *drive)
 }
 
 
+// Assigns track map to inserted floppy, map of recently used floppy is kept
+void AssignTrackMap(struct adfTYPE *drive)
+{
+	unsigned char i, j;
+	unsigned char age;
+	unsigned char used;
+
+	// Look for map of the same file
+	drive->map = TRACK_MAPS;
+	for(i=0; i < TRACK_MAPS; i++)
+	{
+		if(trackMap[i].age < 0xFF)
+		{	trackMap[i].age++;	}
+
+		if(trackMap[i].firstCluster == drive->firstCluster)
+		{	drive->map = i;		}
+	}
+
+	if(TRACK_MAPS == drive->map)
+	{
+		// Take the oldest map not used by other drive
+		drive->map = 0;
+		age = 0;
+		for(i=0; i < TRACK_MAPS; i++)
+		{
+			used = 0;
+			for(j=0; j < MAX_FLOPPY_DRIVES; j++)
+			{
+				if(&df[j] != drive && (df[j].status & DSK_INSERTED) && df[j].map == i && df[j].firstCluster == trackMap[i].firstCluster)
+				{	used = 1;	}
+			}
+
+			if(!used && trackMap[i].age >= age)
+			{
+				age = trackMap[i].age;
+				drive->map = i;
+			}
+		}
+
+		trackMap[drive->map].firstCluster = drive->firstCluster;
+		memset(trackMap[drive->map].contiguous, 0, sizeof(trackMap[drive->map].contiguous));
+	}
+	#ifdef DEBUG_ADF
+	else
+	{	printf("Track map %d kept\r\n", drive->map);	}
+	#endif
+
+	trackMap[drive->map].age = 0;
+}
+
+
+// Sets global file handle to the first sector of current track
+// Cluster chain is followed only for tracks not known in track map yet or following a gap in cluster chain
+void SeekTrack(struct adfTYPE *drive)
+{
+	struct trackMapTYPE *map;
+	unsigned char i, n;
+	unsigned char known;
+	unsigned long cluster;
+
+	map = &trackMap[drive->map];
+
+	// Map taken by other floppy or track out of map, seek from file start
+	if(map->firstCluster != drive->firstCluster || drive->track >= MAX_TRACKS)
+	{
+		FileSeek(&file, (unsigned long)drive->track * SECTOR_COUNT);
+		return;
+	}
+
+	// Start cluster of the last track after a gap in cluster chain
+	known = 0;
+	cluster = drive->firstCluster;
+
+	for(i=1; i <= drive->track; i++)
+	{
+		if(!(map->contiguous[i >> 3] & (1 << (i & 7))))
+		{
+			// Follow cluster chain from previous track start
+			file.cluster = cluster + TRACK_CLUSTER(i - 1) - TRACK_CLUSTER(known);
+			file.sector = (unsigned long)(i - 1) * SECTOR_COUNT;
+			for(n=0; n < SECTOR_COUNT; n++)
+			{	FileNextSector(&file);	}
+
+			if(file.cluster == cluster + TRACK_CLUSTER(i) - TRACK_CLUSTER(known))
+			{	map->contiguous[i >> 3] |= 1 << (i & 7);	}
+			else
+			{
+				cluster = file.cluster;
+				known = i;
+			}
+		}
+	}
+
+	file.cluster = cluster + TRACK_CLUSTER(drive->track) - TRACK_CLUSTER(known);
+	file.sector = (unsigned long)drive->track * SECTOR_COUNT;
+}
+
+
 
 /*CheckTrack, respond with disk status*/
 void CheckTrack(struct adfTYPE *drive)
@@ -180,7 +287,6 @@ void ReadTrack(struct adfTYPE *drive)
 	unsigned char c1, c2, c3, c4;
 	unsigned char dsksynch, dsksyncl;
 	unsigned short n;
-	unsigned long seekSector;
 
 	// display track number: cylinder & head
 	#ifdef DEBUG_ADF
@@ -196,9 +302,7 @@ void ReadTrack(struct adfTYPE *drive)
 		drive->trackprev = drive->track;
 		sector = 0;
 
-		seekSector = (unsigned long)drive->track;
-		seekSector *= SECTOR_COUNT;
-		FileSeek(&file, seekSector);
+		SeekTrack(drive);
 	}
 	else
 	{
@@ -321,9 +425,7 @@ void ReadTrack(struct adfTYPE *drive)
 			//go to the start of current track
 			sector = 0;
 				
-			seekSector = (unsigned long)drive->track;
-			seekSector *= SECTOR_COUNT;
-			FileSeek(&file, seekSector);
+			SeekTrack(drive);
 		}
 
 		#ifdef DEBUG_ADF
@@ -347,15 +449,12 @@ void WriteTrack(struct adfTYPE *drive)
 	unsigned char sector;
 	unsigned char writeTrack;
 	unsigned char writeSector;
-	unsigned long seekSector;
 
 	// Prepare Global File Handle
 	PrepareGlobalFileHandle(drive);
 	
 	//setting file pointer to begining of current track
-	seekSector = (unsigned long)drive->track;
-	seekSector *=SECTOR_COUNT;
-	FileSeek(&file, seekSector);
+	SeekTrack(drive);
 
 	sector = 0;
 
@@ -382,9 +481,7 @@ void WriteTrack(struct adfTYPE *drive)
 					}
 					else
 					{
-						seekSector = (unsigned long)drive->track;
-						seekSector *=SECTOR_COUNT;
-						FileSeek(&file, seekSector);
+						SeekTrack(drive);
 
 						sector = 0;
 					}
@@ -793,6 +890,7 @@ unsigned short SectorToFpga(unsigned char sector, unsigned char track, unsigned
 	SPI(csum[3]|MFM_CLOCK_BITS);
 
 	/*calculate data checksum*/
+	/*XOR is linear so odd and even bits are merged once after all bytes are XOR-ed*/
 	csum[0]=0;
 	csum[1]=0;
 	csum[2]=0;
@@ -801,24 +899,16 @@ unsigned short SectorToFpga(unsigned char sector, unsigned char track, unsigned
 	p=secbuf;
 	do
 	{
-		c=*(p++);
-		csum[0]^=c>>1;
-		csum[0]^=c;
-		c=*(p++);
-		csum[1]^=c>>1;
-		csum[1]^=c;
-		c=*(p++);
-		csum[2]^=c>>1;
-		csum[2]^=c;
-		c=*(p++);
-		csum[3]^=c>>1;
-		csum[3]^=c;
+		csum[0]^=*(p++);
+		csum[1]^=*(p++);
+		csum[2]^=*(p++);
+		csum[3]^=*(p++);
 	}
 	while (--i);
-	csum[0]&=MFM_DATA_BITS_MASK;
-	csum[1]&=MFM_DATA_BITS_MASK;
-	csum[2]&=MFM_DATA_BITS_MASK;
-	csum[3]&=MFM_DATA_BITS_MASK;
+	csum[0]=(csum[0]^(csum[0]>>1))&MFM_DATA_BITS_MASK;
+	csum[1]=(csum[1]^(csum[1]>>1))&MFM_DATA_BITS_MASK;
+	csum[2]=(csum[2]^(csum[2]>>1))&MFM_DATA_BITS_MASK;
+	csum[3]=(csum[3]^(csum[3]>>1))&MFM_DATA_BITS_MASK;
 
 
 	/*checksum over data*/
@@ -20,6 +20,10 @@
 #define	SECTOR_COUNT	11											// Number of secors per track
 #define	LAST_SECTOR		(SECTOR_COUNT - 1)							// Last sector zero based index
 #define	GAP_SIZE		(TRACK_SIZE - SECTOR_COUNT * SECTOR_SIZE)	// Track gap size
+#define	MAX_TRACKS		(84*2)										// Maximum number of tracks in track map
+
+// Track maps of recently used floppies
+#define	TRACK_MAPS		6											// Number of kept track maps
 
 // Some MFM encoding stuff
 #define	MFM_CLOCK_BITS		0xAA	// Clock bits mixed with data
@@ -35,6 +39,16 @@ struct adfTYPE
 	unsigned char	track;			// current track
 	unsigned char	trackprev;		// previous track
 	unsigned char	name[12];		// floppy name
+	unsigned char	map;			// track map index
+};
+
+// Track start clusters stored as deltas to previous track, one bit per track
+// Bit is set when track start cluster is previous track start cluster plus number of clusters taken by previous track
+struct trackMapTYPE
+{
+	unsigned long	firstCluster;				// First cluster of floppy file the map belongs to
+	unsigned char	age;						// Number of inserts since the map was used
+	unsigned char	contiguous[MAX_TRACKS / 8];	// Track bits, track 0 is always known
 };
 
 // Extern structs needed for other modules
@@ -49,6 +63,8 @@ void CheckTrack(struct adfTYPE *drive);
 void ReadTrack(struct adfTYPE *drive);
 void WriteTrack(struct adfTYPE *drive);
 void PrepareGlobalFileHandle(struct adfTYPE *drive);
+void AssignTrackMap(struct adfTYPE *drive);
+void SeekTrack(struct adfTYPE *drive);
 unsigned char FindSync(struct adfTYPE *drive);
 unsigned char GetHeader(unsigned char *pTrack, unsigned char *pSector);
 unsigned char GetData(void);
@@ -0,0 +1,286 @@
+/*
+Copyright 2010 Jakub Bednarski
+
+This file is part of Minimig
+
+Minimig is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+(at your option) any later version.
+
+Minimig is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Host tool converting raw hardfiles to and from sparse hardfile containers (see ARM/HDD.h).
+//
+// build: cc -O2 -o hdfsparse hdfsparse.c
+//
+// usage: hdfsparse create <sparse.hdf> <size in MB> [block size in KB]
+//        hdfsparse pack <raw.hdf> <sparse.hdf> [block size in KB]
+//        hdfsparse unpack <sparse.hdf> <raw.hdf>
+//
+// container layout (all values little endian):
+//   sector 0          header: "MNMGSPR2", size of the disk in sectors, sectors per block, number of map sectors,
+//                     number of data blocks in use
+//   sector 1...       block map, 128 32-bit entries per sector, entry n > 0 is the n-th data block, 0 reads as zeros
+//   following         data blocks in allocation order
+//
+// 2010-09-16 - initial version
+// 2010-09-17 - header holds the number of data blocks in use (delta files can be longer after discard)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SPARSE_ID "MNMGSPR2"
+#define MAP_ENTRIES 128
+#define DEFAULT_BLOCK_KB 32
+
+static void put32(unsigned char *p, unsigned long v)
+{
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+static unsigned long get32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+static unsigned long block_sectors(const char *arg)
+{
+    unsigned long kb = arg ? strtoul(arg, NULL, 0) : DEFAULT_BLOCK_KB;
+
+    if (kb == 0 || kb > 32768 || (kb & (kb - 1)))
+    {
+        fprintf(stderr, "block size must be a power of two between 1 and 32768 KB\n");
+        exit(1);
+    }
+
+    return kb * 2;
+}
+
+static int is_zero(const unsigned char *p, unsigned long n)
+{
+    while (n--)
+        if (*p++)
+            return 0;
+
+    return 1;
+}
+
+// writes container of given size, when in is not NULL the data is taken from raw hardfile and zero blocks are skipped
+static int write_sparse(FILE *in, const char *name, unsigned long size, unsigned long block_size)
+{
+    unsigned long blocks = (size + block_size - 1) / block_size;
+    unsigned long map_size = (blocks + MAP_ENTRIES - 1) / MAP_ENTRIES;
+    unsigned char *map = calloc(map_size, 512);
+    unsigned char *data = malloc(block_size * 512);
+    unsigned char header[512];
+    unsigned long allocated = 0;
+    unsigned long i;
+    size_t n;
+    FILE *out;
+
+    if (!map || !data)
+    {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    out = fopen(name, "wb");
+    if (!out)
+    {
+        perror(name);
+        return 1;
+    }
+
+    memset(header, 0, sizeof(header));
+    memcpy(header, SPARSE_ID, 8);
+    put32(&header[8], size);
+    put32(&header[12], block_size);
+    put32(&header[16], map_size);
+
+    // the map is written again when all data blocks are known
+    fwrite(header, 512, 1, out);
+    fwrite(map, 512, map_size, out);
+
+    for (i = 0; in && i < blocks; i++)
+    {
+        memset(data, 0, block_size * 512);
+        n = fread(data, 1, block_size * 512, in);
+        if (n == 0)
+            break;
+
+        if (!is_zero(data, n))
+        {
+            put32(&map[i * 4], ++allocated);
+            if (fwrite(data, 512, block_size, out) != block_size)
+            {
+                perror(name);
+                return 1;
+            }
+        }
+    }
+
+    put32(&header[20], allocated);
+    fseek(out, 0, SEEK_SET);
+    fwrite(header, 512, 1, out);
+    fwrite(map, 512, map_size, out);
+
+    if (fclose(out))
+    {
+        perror(name);
+        return 1;
+    }
+
+    printf("%s: %lu MB, %lu KB blocks, %lu of %lu blocks allocated\n", name, size >> 11, block_size >> 1, allocated, blocks);
+
+    free(map);
+    free(data);
+    return 0;
+}
+
+static int unpack(const char *src, const char *dst)
+{
+    unsigned char header[512];
+    unsigned char *map;
+    unsigned char *data;
+    unsigned long size, block_size, map_size, blocks, used, entry, i, n;
+    FILE *in, *out;
+
+    in = fopen(src, "rb");
+    if (!in)
+    {
+        perror(src);
+        return 1;
+    }
+
+    if (fread(header, 512, 1, in) != 1 || memcmp(header, SPARSE_ID, 8))
+    {
+        fprintf(stderr, "%s: not a sparse hardfile\n", src);
+        return 1;
+    }
+
+    size = get32(&header[8]);
+    block_size = get32(&header[12]);
+    map_size = get32(&header[16]);
+    used = get32(&header[20]);
+    blocks = (size + block_size - 1) / block_size;
+
+    if (block_size == 0 || map_size < (blocks + MAP_ENTRIES - 1) / MAP_ENTRIES)
+    {
+        fprintf(stderr, "%s: invalid header\n", src);
+        return 1;
+    }
+
+    map = malloc(map_size * 512);
+    data = malloc(block_size * 512);
+    if (!map || !data || fread(map, 512, map_size, in) != map_size)
+    {
+        fprintf(stderr, "%s: can't read block map\n", src);
+        return 1;
+    }
+
+    out = fopen(dst, "wb");
+    if (!out)
+    {
+        perror(dst);
+        return 1;
+    }
+
+    for (i = 0; i < blocks; i++)
+    {
+        entry = get32(&map[i * 4]);
+        memset(data, 0, block_size * 512);
+
+        if (entry > used)
+        {
+            fprintf(stderr, "%s: invalid map entry %lu\n", src, entry);
+            return 1;
+        }
+
+        if (entry)
+        {
+            fseek(in, (1 + map_size + (entry - 1) * block_size) * 512, SEEK_SET);
+            if (fread(data, 512, block_size, in) != block_size)
+            {
+                fprintf(stderr, "%s: data block %lu truncated\n", src, entry);
+                return 1;
+            }
+        }
+
+        n = size - i * block_size; // the last block may be partial
+        if (n > block_size)
+            n = block_size;
+
+        if (fwrite(data, 512, n, out) != n)
+        {
+            perror(dst);
+            return 1;
+        }
+    }
+
+    fclose(in);
+    if (fclose(out))
+    {
+        perror(dst);
+        return 1;
+    }
+
+    printf("%s: %lu MB\n", dst, size >> 11);
+
+    free(map);
+    free(data);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    FILE *in;
+    long size;
+    int rc;
+
+    if (argc >= 4 && !strcmp(argv[1], "create"))
+        return write_sparse(NULL, argv[2], strtoul(argv[3], NULL, 0) << 11, block_sectors(argc > 4 ? argv[4] : NULL));
+
+    if (argc >= 4 && !strcmp(argv[1], "pack"))
+    {
+        in = fopen(argv[2], "rb");
+        if (!in)
+        {
+            perror(argv[2]);
+            return 1;
+        }
+
+        fseek(in, 0, SEEK_END);
+        size = ftell(in);
+        fseek(in, 0, SEEK_SET);
+
+        if (size <= 0 || (size & 511))
+        {
+            fprintf(stderr, "%s: size is not a multiple of 512 bytes\n", argv[2]);
+            return 1;
+        }
+
+        rc = write_sparse(in, argv[3], (unsigned long)size >> 9, block_sectors(argc > 4 ? argv[4] : NULL));
+        fclose(in);
+        return rc;
+    }
+
+    if (argc == 4 && !strcmp(argv[1], "unpack"))
+        return unpack(argv[2], argv[3]);
+
+    fprintf(stderr, "usage: hdfsparse create <sparse.hdf> <size in MB> [block size in KB]\n");
+    fprintf(stderr, "       hdfsparse pack <raw.hdf> <sparse.hdf> [block size in KB]\n");
+    fprintf(stderr, "       hdfsparse unpack <sparse.hdf> <raw.hdf>\n");
+    return 1;
+}
@@ -0,0 +1,15 @@
+// Host shim for building the firmware's HDD and FAT code into idereplay (cc -include idehost.h).
+// The processor registers used by HDD.c are redirected to a host variable.
+
+#include "AT91SAM7S256.h"
+
+#define __noinline
+
+extern AT91_REG host_register;
+
+#undef AT91C_PIOA_SODR
+#define AT91C_PIOA_SODR (&host_register)
+#undef AT91C_PIOA_CODR
+#define AT91C_PIOA_CODR (&host_register)
+#undef AT91C_PITC_PIIR
+#define AT91C_PITC_PIIR (&host_register)
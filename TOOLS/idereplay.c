@@ -0,0 +1,466 @@
+/*
+Copyright 2010 Jakub Bednarski
+
+This file is part of Minimig
+
+Minimig is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+(at your option) any later version.
+
+Minimig is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Host tool replaying IDE command traces (see ARM/HDD.h) against a card image through the firmware's own HDD and FAT code.
+// Every traced command is fed to HandleHDD() through an emulation of the FPGA's IDE registers.
+//
+// build (unsigned long has to be 32-bit like on the ARM):
+//   cc -m32 -O2 -I../ARM -include idehost.h -o idereplay idereplay.c ../ARM/FAT.c ../ARM/HDD.c
+//
+// usage: idereplay <card image> <trace> <master.hdf> [<slave.hdf>]
+//
+// The card image is a dump of the whole card (MBR and FAT partition) holding the hardfiles in its root directory.
+// It is modified by the write commands of the trace (written sectors get a pattern as the data isn't traced), use a copy.
+// The trace is either IDETRACE.TRC captured to the card (F10 in the firmware options menu)
+// or the IDETRACE lines dumped to the serial port (F9).
+//
+// Card accesses are counted where the firmware calls the MMC driver, these numbers don't depend on the host
+// and are the main figure for comparing firmware builds. Host times only show relative costs.
+//
+// 2010-09-18 - initial version
+// 2010-10-06 - commands are replayed through HandleHDD() instead of a copy of its storage operations
+//            - host shim for the processor registers and __noinline (idehost.h)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "AT91SAM7S256.h"
+#include "hardware.h"
+#include "FAT.h"
+#include "HDD.h"
+#include "MMC.h"
+#include "FPGA.h"
+#include "config.h"
+
+configTYPE config;
+AT91_REG host_register;
+
+FILE *card;
+unsigned char scratch[512 * 256];
+
+// card access statistics
+unsigned long card_reads;
+unsigned long card_writes;
+unsigned long card_read_sectors;
+unsigned long card_write_sectors;
+
+// replay statistics per command class
+enum {CLASS_READ, CLASS_WRITE, CLASS_FLUSH, CLASS_OTHER, CLASSES};
+const char *class_name[CLASSES] = {"read", "write", "flush", "other"};
+
+typedef struct
+{
+    unsigned long commands;
+    unsigned long sectors;
+    double        host_time;    // microseconds
+    double        host_max;
+    double        traced_time;  // microseconds
+    double        traced_max;
+    unsigned long card_reads;
+    unsigned long card_writes;
+} statTYPE;
+
+statTYPE stat[CLASSES];
+
+/* firmware environment */
+
+unsigned char CardAccess(unsigned long lba, unsigned char *pBuffer, unsigned long nBlockCount, int write)
+{
+    if (fseek(card, (long)lba * 512, SEEK_SET))
+        return 0;
+
+    if (write)
+    {
+        card_writes++;
+        card_write_sectors += nBlockCount;
+        if (!pBuffer) // multiple sector write with NULL buffer clears sectors
+        {
+            memset(scratch, 0, sizeof(scratch));
+            while (nBlockCount > 256)
+            {
+                fwrite(scratch, 512, 256, card);
+                nBlockCount -= 256;
+            }
+            pBuffer = scratch;
+        }
+        return fwrite(pBuffer, 512, nBlockCount, card) == nBlockCount;
+    }
+
+    card_reads++;
+    card_read_sectors += nBlockCount;
+    if (!pBuffer) // direct transfer to the FPGA
+    {
+        while (nBlockCount > 256)
+        {
+            if (fread(scratch, 512, 256, card) != 256)
+                return 0;
+            nBlockCount -= 256;
+        }
+        pBuffer = scratch;
+    }
+    return fread(pBuffer, 512, nBlockCount, card) == nBlockCount;
+}
+
+unsigned char MMC_Read(unsigned long lba, unsigned char *pReadBuffer)
+{
+    return CardAccess(lba, pReadBuffer, 1, 0);
+}
+
+unsigned char MMC_Write(unsigned long lba, unsigned char *pWriteBuffer)
+{
+    return CardAccess(lba, pWriteBuffer, 1, 1);
+}
+
+unsigned char MMC_ReadMultiple(unsigned long lba, unsigned char *pReadBuffer, unsigned long nBlockCount)
+{
+    return CardAccess(lba, pReadBuffer, nBlockCount, 0);
+}
+
+unsigned char MMC_WriteMultiple(unsigned long lba, unsigned char *pWriteBuffer, unsigned long nBlockCount)
+{
+    return CardAccess(lba, pWriteBuffer, nBlockCount, 1);
+}
+
+unsigned long CalculateCRC32(unsigned long crc, unsigned char *pBuffer, unsigned long nSize)
+{
+    static unsigned long table[256];
+    unsigned long c;
+    int i, j;
+
+    if (!table[1])
+        for (i = 0; i < 256; i++)
+        {
+            for (c = i, j = 0; j < 8; j++)
+                c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+
+    while (nSize--)
+        crc = table[(unsigned char)crc ^ *pBuffer++] ^ crc >> 8;
+
+    return crc;
+}
+
+unsigned long GetTimer(unsigned long offset)
+{
+    return ((unsigned long)(clock() * 1000 / CLOCKS_PER_SEC) + offset) << 20;
+}
+
+unsigned long CheckTimer(unsigned long time)
+{
+    return (time - GetTimer(0)) > (1UL << 31);
+}
+
+// FPGA emulation: HandleHDD() reads the task file registers and the write data through SPI
+
+unsigned char fpga_tfr[8];  // task file registers of the replayed command
+unsigned long fpga_lba;     // sector of the next write data transfer
+unsigned char fpga_cmd;     // command of the current SPI transfer
+unsigned long fpga_pos;     // byte position in the current SPI transfer
+
+unsigned char SPI(unsigned char outByte)
+{
+    unsigned long pos = fpga_pos++;
+
+    if (pos == 0)
+        fpga_cmd = outByte;
+    else if (fpga_cmd == CMD_IDE_REGS_RD && pos >= 7 && pos < 23 && pos & 1) // 5 bytes (reset counter last) then 8 registers, high bytes first
+        return fpga_tfr[(pos - 7) >> 1];
+    else if (fpga_cmd == CMD_IDE_DATA_RD && pos >= 6) // recognizable pattern: sector number
+        return (unsigned char)(fpga_lba >> ((pos - 6) & 3) * 8);
+
+    return 0;
+}
+
+void EnableFpga(void)
+{
+    fpga_pos = 0;
+}
+
+void DisableFpga(void)
+{
+    if (fpga_cmd == CMD_IDE_DATA_RD)
+        fpga_lba++;
+    fpga_cmd = 0;
+}
+
+unsigned char GetFPGAStatus(void)
+{
+    return 0;
+}
+
+unsigned char WaitFPGAStatus(unsigned char mask)
+{
+    return mask;
+}
+
+void Yield(unsigned char tasks)
+{
+}
+
+void ErrorMessage(char *message, unsigned char code)
+{
+    printf("%s\n", message);
+}
+
+/* replay */
+
+double Microseconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+unsigned long Get32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+// reads next record from binary capture file or serial dump, returns 0 at the end of the trace
+int ReadRecord(FILE *f, int text, unsigned long *remaining, tracerecordTYPE *r)
+{
+    unsigned char b[16];
+    char line[256];
+    unsigned long t, d, lba;
+    unsigned int cmd, unit, count, features;
+
+    if (!text)
+    {
+        if (!*remaining || fread(b, 16, 1, f) != 1)
+            return 0;
+
+        (*remaining)--;
+        r->time = Get32(&b[0]);
+        r->duration = Get32(&b[4]);
+        r->lba = Get32(&b[8]);
+        r->count = b[12];
+        r->command = b[13];
+        r->unit = b[14];
+        r->features = b[15];
+        return 1;
+    }
+
+    while (fgets(line, sizeof(line), f))
+    {
+        char *p = strstr(line, "IDETRACE ");
+        features = 0;
+        if (p && sscanf(p, "IDETRACE %lu %lu %x %u %lu %u %x", &t, &d, &cmd, &unit, &lba, &count, &features) >= 6)
+        {
+            r->time = t;
+            r->duration = d;
+            r->command = cmd;
+            r->unit = unit;
+            r->lba = lba;
+            r->count = count;
+            r->features = features;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// replays the command through HandleHDD(), returns command class
+int Replay(tracerecordTYPE *r, unsigned long *sectors)
+{
+    unsigned long count = r->count ? r->count : 0x100;
+    unsigned long lba = r->lba;
+
+    *sectors = 0;
+    if (r->command == IDE_TRACE_FLUSH) // done by HandleHDDBackground() when the write-back buffer timed out
+    {
+        FlushWriteCache();
+        return CLASS_FLUSH;
+    }
+
+    // the traced sector address is given to the firmware in LBA mode
+    fpga_tfr[0] = 0;
+    fpga_tfr[1] = r->features;
+    fpga_tfr[2] = r->count;
+    fpga_tfr[3] = (unsigned char)lba;
+    fpga_tfr[4] = (unsigned char)(lba >> 8);
+    fpga_tfr[5] = (unsigned char)(lba >> 16);
+    fpga_tfr[6] = 0xA0 | IDE_DRIVEHEAD_LBA | (r->unit & 1) << 4 | (lba >> 24 & 0x0F);
+    fpga_tfr[7] = r->command;
+    fpga_lba = lba;
+
+    HandleHDD(CMD_IDECMD, 0);
+
+    switch (r->command)
+    {
+    case ACMD_READ_SECTORS :
+    case ACMD_READ_MULTIPLE :
+        *sectors = count;
+        return CLASS_READ;
+
+    case ACMD_WRITE_SECTORS :
+    case ACMD_WRITE_MULTIPLE :
+        *sectors = count;
+        return CLASS_WRITE;
+
+    case ACMD_FLUSH_CACHE :
+        return CLASS_FLUSH;
+    }
+
+    return CLASS_OTHER;
+}
+
+void SetHardfile(unsigned char unit, const char *name)
+{
+    // hardfile name in 8.3 format, the extension has to be HDF
+
+    const char *dot = strchr(name, '.');
+    size_t len = dot ? (size_t)(dot - name) : strlen(name);
+    size_t i;
+
+    memset(config.hardfile[unit].name, ' ', sizeof(config.hardfile[unit].name));
+    for (i = 0; i < len && i < sizeof(config.hardfile[unit].name); i++)
+        config.hardfile[unit].name[i] = name[i] >= 'a' && name[i] <= 'z' ? name[i] - 32 : name[i];
+
+    config.hardfile[unit].enabled = HDF_FILE;
+}
+
+int main(int argc, char **argv)
+{
+    FILE *f;
+    unsigned char header[512];
+    unsigned long remaining = 0;
+    unsigned long sectors;
+    unsigned long records = 0;
+    unsigned long total_sectors = 0;
+    unsigned long reads;
+    unsigned long writes;
+    double start, t, total = 0, traced_total = 0;
+    tracerecordTYPE r;
+    statTYPE *s;
+    int text;
+    int c;
+
+    if (sizeof(unsigned long) != 4)
+    {
+        fprintf(stderr, "idereplay has to be built with 32-bit unsigned long (-m32)\n");
+        return 1;
+    }
+
+    if (argc < 4)
+    {
+        fprintf(stderr, "usage: idereplay <card image> <trace> <master.hdf> [<slave.hdf>]\n");
+        return 1;
+    }
+
+    card = fopen(argv[1], "r+b");
+    if (!card)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+
+    f = fopen(argv[2], "rb");
+    if (!f)
+    {
+        perror(argv[2]);
+        return 1;
+    }
+
+    text = !(fread(header, 512, 1, f) == 1 && memcmp(header, IDE_TRACE_ID, 8) == 0);
+    if (text)
+        rewind(f);
+    else
+    {
+        remaining = Get32(&header[8]);
+        if (Get32(&header[12]))
+            printf("warning: %lu records were dropped during capture\n", Get32(&header[12]));
+    }
+
+    if (!FindDrive())
+    {
+        fprintf(stderr, "%s: no FAT partition found\n", argv[1]);
+        return 1;
+    }
+
+    SetHardfile(0, argv[3]);
+    if (argc > 4)
+        SetHardfile(1, argv[4]);
+
+    if (!OpenHardfile(0))
+    {
+        fprintf(stderr, "%s: can't open hardfile\n", argv[3]);
+        return 1;
+    }
+
+    if (argc > 4 && !OpenHardfile(1))
+    {
+        fprintf(stderr, "%s: can't open hardfile\n", argv[4]);
+        return 1;
+    }
+
+    while (ReadRecord(f, text, &remaining, &r))
+    {
+        reads = card_reads;
+        writes = card_writes;
+
+        start = Microseconds();
+        c = Replay(&r, &sectors);
+        t = Microseconds() - start;
+
+        s = &stat[c];
+        s->commands++;
+        s->sectors += sectors;
+        s->host_time += t;
+        if (t > s->host_max)
+            s->host_max = t;
+        s->traced_time += r.duration;
+        if (r.duration > s->traced_max)
+            s->traced_max = r.duration;
+        s->card_reads += card_reads - reads;
+        s->card_writes += card_writes - writes;
+
+        records++;
+        total_sectors += sectors;
+        total += t;
+        traced_total += r.duration;
+    }
+
+    FlushWriteCache();
+    fclose(f);
+    fclose(card);
+
+    printf("\n%lu commands, %lu sectors\n", records, total_sectors);
+    printf("%-6s %8s %9s %10s %10s %10s %10s %10s %10s\n", "class", "commands", "sectors", "card rd", "card wr", "host avg", "host max", "trace avg", "trace max");
+    for (c = 0; c < CLASSES; c++)
+    {
+        s = &stat[c];
+        if (!s->commands)
+            continue;
+
+        printf("%-6s %8lu %9lu %10lu %10lu %8.1fus %8.1fus %8.1fus %8.1fus\n", class_name[c], s->commands, s->sectors, s->card_reads, s->card_writes,
+            s->host_time / s->commands, s->host_max, s->traced_time / s->commands, s->traced_max);
+    }
+
+    printf("card: %lu reads (%lu sectors), %lu writes (%lu sectors), %lu FAT reads\n", card_reads, card_read_sectors, card_writes, card_write_sectors, fat_reads);
+    if (total > 0)
+        printf("host throughput: %.2f MB/s\n", total_sectors / 2048.0 / (total / 1e6));
+    if (traced_total > 0)
+        printf("traced throughput: %.2f MB/s\n", total_sectors / 2048.0 / (traced_total / 1e6));
+
+    return 0;
+}
@@ -0,0 +1,553 @@
+/*
+Copyright 2010 Jakub Bednarski
+
+This file is part of Minimig
+
+Minimig is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+(at your option) any later version.
+
+Minimig is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+// Host tool packing ADF images into LZ4 compressed images read by the firmware (see ARM/FDD.c)
+// and ROM or FPGA core files into compressed files decompressed during upload (see ARM/LZ4.c).
+//
+// build: cc -O2 -o lz4pack lz4pack.c
+//
+// usage: lz4pack adf <image.adf> <image.adc>
+//        lz4pack unadf <image.adc> <image.adf>
+//        lz4pack rom <file> <packed file>
+//        lz4pack unrom <packed file> <file>
+//
+// compressed ADF layout (all values little endian):
+//   bytes 0-7      "MNMGADC1"
+//   bytes 8-9      number of tracks
+//   bytes 10-15    reserved
+//   bytes 16...    byte offsets of compressed tracks in the file, 32-bit entry per track
+//   following      LZ4 blocks (block format without frame), one per track of 11 sectors
+//
+// Every track is decompressed on its own so the firmware needs only the track buffer and sector buffer.
+// Packing prints the average number of card sectors read per track (11 for raw ADF), the firmware prints
+// the time taken by each track (Z<track> lines) when floppy debug output is enabled.
+//
+// compressed ROM and FPGA core file layout (all values little endian):
+//   bytes 0-7      "MNMGLZ4F"
+//   bytes 8-11     uncompressed size
+//   bytes 12-15    reserved
+//   following      LZ4 blocks, one per 2 KB of uncompressed data (the last one may be shorter)
+//
+// The packed file replaces the original one (KICK.ROM, AR3.ROM, MINIMIG1.BIN), the firmware recognizes it by its id.
+// Holding F3 at boot prints a comparison of the compressed upload with a raw read at the current SPI clock.
+//
+// 2010-09-29 - initial version
+// 2010-10-05 - compressed ROM and FPGA core files
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ADC_ID "MNMGADC1"
+#define ROM_ID "MNMGLZ4F"
+#define ROM_CHUNK 2048
+#define HEADER_SIZE 16
+#define TRACK_SIZE (11 * 512)
+#define MAX_TRACKS (83 * 2)
+
+#define MIN_MATCH 4
+#define LAST_LITERALS 5 // the last 5 bytes of a block are always literals
+#define MF_LIMIT 12 // the last match must start at least 12 bytes before the end of a block
+#define HASH_BITS 12
+
+static void put32(unsigned char *p, unsigned long v)
+{
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+static unsigned long get32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+static unsigned long hash(const unsigned char *p)
+{
+    unsigned long v = get32(p) & 0xFFFFFFFF;
+
+    return ((v * 2654435761UL) & 0xFFFFFFFF) >> (32 - HASH_BITS);
+}
+
+static unsigned char *put_length(unsigned char *op, unsigned long len)
+{
+    // length extension bytes of a token nibble set to 15
+    len -= 15;
+    while (len >= 255)
+    {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+static unsigned char *put_sequence(unsigned char *op, const unsigned char *lit, unsigned long lit_len, unsigned long offset, unsigned long match_len)
+{
+    // match_len 0 means the last sequence (literals only)
+    unsigned char *token = op++;
+
+    *token = (unsigned char)((lit_len >= 15 ? 15 : lit_len) << 4);
+    if (lit_len >= 15)
+        op = put_length(op, lit_len);
+
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+
+    if (match_len)
+    {
+        *op++ = (unsigned char)offset;
+        *op++ = (unsigned char)(offset >> 8);
+
+        match_len -= MIN_MATCH;
+        *token |= match_len >= 15 ? 15 : match_len;
+        if (match_len >= 15)
+            op = put_length(op, match_len);
+    }
+    return op;
+}
+
+// greedy LZ4 block compression, returns compressed size (dst must hold n + n / 255 + 16 bytes)
+static unsigned long compress_block(const unsigned char *src, unsigned long n, unsigned char *dst)
+{
+    long table[1 << HASH_BITS];
+    unsigned long ip = 0;
+    unsigned long anchor = 0;
+    unsigned long limit = n > MF_LIMIT ? n - MF_LIMIT : 0;
+    unsigned long len;
+    unsigned long h;
+    long ref;
+    unsigned char *op = dst;
+
+    for (h = 0; h < (1 << HASH_BITS); h++)
+        table[h] = -1;
+
+    while (ip < limit)
+    {
+        h = hash(&src[ip]);
+        ref = table[h];
+        table[h] = ip;
+
+        if (ref >= 0 && ip - ref <= 65535 && !memcmp(&src[ref], &src[ip], MIN_MATCH))
+        {
+            len = MIN_MATCH;
+            while (ip + len < n - LAST_LITERALS && src[ref + len] == src[ip + len])
+                len++;
+
+            op = put_sequence(op, &src[anchor], ip - anchor, ip - ref, len);
+            ip += len;
+            anchor = ip;
+        }
+        else
+            ip++;
+    }
+
+    op = put_sequence(op, &src[anchor], n - anchor, 0, 0);
+    return op - dst;
+}
+
+// LZ4 block decompression, returns the compressed block size or 0 if the block doesn't decompress to exactly n bytes
+static unsigned long decompress_block(const unsigned char *src, unsigned long size, unsigned char *dst, unsigned long n)
+{
+    const unsigned char *start = src;
+    const unsigned char *end = src + size;
+    unsigned long op = 0;
+    unsigned long len;
+    unsigned long offset;
+    unsigned char token;
+
+    while (src < end)
+    {
+        token = *src++;
+        len = token >> 4;
+        if (len == 15)
+            do
+                len += *src;
+            while (*src++ == 255 && src < end);
+
+        if (len > n - op || len > (unsigned long)(end - src))
+            return 0;
+        memcpy(&dst[op], src, len);
+        op += len;
+        src += len;
+
+        if (op == n)
+            return src - start;
+
+        if (end - src < 2)
+            return 0;
+        offset = src[0] | src[1] << 8;
+        src += 2;
+        if (offset == 0 || offset > op)
+            return 0;
+
+        len = token & 15;
+        if (len == 15)
+            do
+                len += *src;
+            while (*src++ == 255 && src < end);
+        len += MIN_MATCH;
+
+        if (len > n - op)
+            return 0;
+        while (len--)
+        {
+            dst[op] = dst[op - offset];
+            op++;
+        }
+    }
+    return 0;
+}
+
+static int pack_adf(const char *src, const char *dst)
+{
+    unsigned char *adf;
+    unsigned char *packed;
+    unsigned char header[HEADER_SIZE + MAX_TRACKS * 4];
+    unsigned long tracks, offset, size, sectors, total_sectors, i;
+    long file_size;
+    FILE *in, *out;
+
+    in = fopen(src, "rb");
+    if (!in)
+    {
+        perror(src);
+        return 1;
+    }
+
+    fseek(in, 0, SEEK_END);
+    file_size = ftell(in);
+    fseek(in, 0, SEEK_SET);
+
+    tracks = file_size / TRACK_SIZE;
+    if (file_size <= 0 || file_size % TRACK_SIZE || tracks > MAX_TRACKS)
+    {
+        fprintf(stderr, "%s: size is not a multiple of track size (%u bytes) or too many tracks\n", src, TRACK_SIZE);
+        return 1;
+    }
+
+    adf = malloc(file_size);
+    packed = malloc(TRACK_SIZE + TRACK_SIZE / 255 + 16);
+    if (!adf || !packed)
+    {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    if (fread(adf, TRACK_SIZE, tracks, in) != tracks)
+    {
+        perror(src);
+        return 1;
+    }
+    fclose(in);
+
+    out = fopen(dst, "wb");
+    if (!out)
+    {
+        perror(dst);
+        return 1;
+    }
+
+    memset(header, 0, sizeof(header));
+    memcpy(header, ADC_ID, 8);
+    header[8] = (unsigned char)tracks;
+    header[9] = (unsigned char)(tracks >> 8);
+
+    // the index is written again when all track offsets are known
+    offset = HEADER_SIZE + tracks * 4;
+    fwrite(header, offset, 1, out);
+
+    total_sectors = 0;
+    for (i = 0; i < tracks; i++)
+    {
+        size = compress_block(&adf[i * TRACK_SIZE], TRACK_SIZE, packed);
+        put32(&header[HEADER_SIZE + i * 4], offset);
+
+        // card sectors the firmware reads to decompress this track
+        sectors = ((offset & 511) + size + 511) >> 9;
+        total_sectors += sectors;
+
+        if (fwrite(packed, 1, size, out) != size)
+        {
+            perror(dst);
+            return 1;
+        }
+        offset += size;
+    }
+
+    fseek(out, 0, SEEK_SET);
+    fwrite(header, HEADER_SIZE + tracks * 4, 1, out);
+
+    if (fclose(out))
+    {
+        perror(dst);
+        return 1;
+    }
+
+    printf("%s: %lu tracks, %lu KB -> %lu KB (%lu%%)\n", dst, tracks, (unsigned long)file_size >> 10, offset >> 10, offset * 100 / file_size);
+    printf("card sectors read per track: %lu.%02lu (raw ADF: 11)\n", total_sectors / tracks, total_sectors % tracks * 100 / tracks);
+
+    free(adf);
+    free(packed);
+    return 0;
+}
+
+static int unpack_adf(const char *src, const char *dst)
+{
+    unsigned char *adc;
+    unsigned char track[TRACK_SIZE];
+    unsigned long tracks, offset, next, i;
+    long file_size;
+    FILE *in, *out;
+
+    in = fopen(src, "rb");
+    if (!in)
+    {
+        perror(src);
+        return 1;
+    }
+
+    fseek(in, 0, SEEK_END);
+    file_size = ftell(in);
+    fseek(in, 0, SEEK_SET);
+
+    adc = malloc(file_size);
+    if (!adc || fread(adc, 1, file_size, in) != (size_t)file_size)
+    {
+        fprintf(stderr, "%s: can't read file\n", src);
+        return 1;
+    }
+    fclose(in);
+
+    if (file_size < HEADER_SIZE || memcmp(adc, ADC_ID, 8))
+    {
+        fprintf(stderr, "%s: not a compressed ADF image\n", src);
+        return 1;
+    }
+
+    tracks = adc[8] | adc[9] << 8;
+    if (tracks > MAX_TRACKS || (unsigned long)file_size < HEADER_SIZE + tracks * 4)
+    {
+        fprintf(stderr, "%s: invalid header\n", src);
+        return 1;
+    }
+
+    out = fopen(dst, "wb");
+    if (!out)
+    {
+        perror(dst);
+        return 1;
+    }
+
+    for (i = 0; i < tracks; i++)
+    {
+        offset = get32(&adc[HEADER_SIZE + i * 4]);
+        next = i + 1 < tracks ? get32(&adc[HEADER_SIZE + (i + 1) * 4]) : (unsigned long)file_size;
+
+        if (offset > next || next > (unsigned long)file_size || !decompress_block(&adc[offset], next - offset, track, TRACK_SIZE))
+        {
+            fprintf(stderr, "%s: track %lu is corrupted\n", src, i);
+            return 1;
+        }
+
+        if (fwrite(track, TRACK_SIZE, 1, out) != 1)
+        {
+            perror(dst);
+            return 1;
+        }
+    }
+
+    if (fclose(out))
+    {
+        perror(dst);
+        return 1;
+    }
+
+    printf("%s: %lu tracks\n", dst, tracks);
+
+    free(adc);
+    return 0;
+}
+
+static int pack_rom(const char *src, const char *dst)
+{
+    unsigned char *rom;
+    unsigned char packed[ROM_CHUNK + ROM_CHUNK / 255 + 16];
+    unsigned char header[HEADER_SIZE];
+    unsigned long offset, size, n, i;
+    long file_size;
+    FILE *in, *out;
+
+    in = fopen(src, "rb");
+    if (!in)
+    {
+        perror(src);
+        return 1;
+    }
+
+    fseek(in, 0, SEEK_END);
+    file_size = ftell(in);
+    fseek(in, 0, SEEK_SET);
+
+    rom = malloc(file_size);
+    if (file_size <= 0 || !rom || fread(rom, 1, file_size, in) != (size_t)file_size)
+    {
+        fprintf(stderr, "%s: can't read file\n", src);
+        return 1;
+    }
+    fclose(in);
+
+    out = fopen(dst, "wb");
+    if (!out)
+    {
+        perror(dst);
+        return 1;
+    }
+
+    memset(header, 0, sizeof(header));
+    memcpy(header, ROM_ID, 8);
+    put32(&header[8], file_size);
+    fwrite(header, HEADER_SIZE, 1, out);
+
+    offset = HEADER_SIZE;
+    for (i = 0; i < (unsigned long)file_size; i += n)
+    {
+        n = file_size - i;
+        if (n > ROM_CHUNK)
+            n = ROM_CHUNK;
+
+        size = compress_block(&rom[i], n, packed);
+        if (fwrite(packed, 1, size, out) != size)
+        {
+            perror(dst);
+            return 1;
+        }
+        offset += size;
+    }
+
+    if (fclose(out))
+    {
+        perror(dst);
+        return 1;
+    }
+
+    printf("%s: %lu KB -> %lu KB (%lu%%)\n", dst, (unsigned long)file_size >> 10, offset >> 10, offset * 100 / file_size);
+
+    free(rom);
+    return 0;
+}
+
+static int unpack_rom(const char *src, const char *dst)
+{
+    unsigned char *packed;
+    unsigned char chunk[ROM_CHUNK];
+    unsigned long offset, size, n, i, used;
+    long file_size;
+    FILE *in, *out;
+
+    in = fopen(src, "rb");
+    if (!in)
+    {
+        perror(src);
+        return 1;
+    }
+
+    fseek(in, 0, SEEK_END);
+    file_size = ftell(in);
+    fseek(in, 0, SEEK_SET);
+
+    packed = malloc(file_size);
+    if (!packed || fread(packed, 1, file_size, in) != (size_t)file_size)
+    {
+        fprintf(stderr, "%s: can't read file\n", src);
+        return 1;
+    }
+    fclose(in);
+
+    if (file_size < HEADER_SIZE || memcmp(packed, ROM_ID, 8))
+    {
+        fprintf(stderr, "%s: not a compressed ROM or FPGA core file\n", src);
+        return 1;
+    }
+
+    size = get32(&packed[8]);
+
+    out = fopen(dst, "wb");
+    if (!out)
+    {
+        perror(dst);
+        return 1;
+    }
+
+    offset = HEADER_SIZE;
+    for (i = 0; i < size; i += n)
+    {
+        n = size - i;
+        if (n > ROM_CHUNK)
+            n = ROM_CHUNK;
+
+        used = decompress_block(&packed[offset], file_size - offset, chunk, n);
+        if (!used)
+        {
+            fprintf(stderr, "%s: block at offset %lu is corrupted\n", src, offset);
+            return 1;
+        }
+        offset += used;
+
+        if (fwrite(chunk, n, 1, out) != 1)
+        {
+            perror(dst);
+            return 1;
+        }
+    }
+
+    if (fclose(out))
+    {
+        perror(dst);
+        return 1;
+    }
+
+    printf("%s: %lu bytes\n", dst, size);
+
+    free(packed);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc == 4 && !strcmp(argv[1], "adf"))
+        return pack_adf(argv[2], argv[3]);
+
+    if (argc == 4 && !strcmp(argv[1], "unadf"))
+        return unpack_adf(argv[2], argv[3]);
+
+    if (argc == 4 && !strcmp(argv[1], "rom"))
+        return pack_rom(argv[2], argv[3]);
+
+    if (argc == 4 && !strcmp(argv[1], "unrom"))
+        return unpack_rom(argv[2], argv[3]);
+
+    fprintf(stderr, "usage: lz4pack adf <image.adf> <image.adc>\n");
+    fprintf(stderr, "       lz4pack unadf <image.adc> <image.adf>\n");
+    fprintf(stderr, "       lz4pack rom <file> <packed file>\n");
+    fprintf(stderr, "       lz4pack unrom <packed file> <file>\n");
+    return 1;
+}